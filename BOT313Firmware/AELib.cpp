@@ -1,37 +1,227 @@
 #include "Config.h"
 
-#define AELIB_MaxLoops 16
+// Max number of timed and event driven tasks
+#define AELIB_MaxTasks 16
+#define AELIB_MaxEvents 4
+// Interval used for tasks registered with registerLoop()
+#define AELIB_LoopInterval ((unsigned long)10)
+// Max time to sleep between Loop() passes
+#define AELIB_MaxSleep ((unsigned long)100)
+// Event conditions polling period while sleeping
+#define AELIB_EventPoll ((unsigned long)5)
+// Number of log2 execution time buckets used to estimate p99
+#define AELIB_StatBuckets 16
+// Task name length reported in loop statistics
+#define AELIB_StatNameLength 16
 
-unsigned int aelibLoopCount=0;
+struct AELibTask {
+  LOOP;
+  unsigned long due;
+  unsigned long interval;
+  int stats;
+};
 
-LOOP aelibLoops[ AELIB_MaxLoops ];
+struct AELibEvent {
+  EVENT;
+  LOOP;
+  int stats;
+};
 
-#ifdef ShowLoopTimes
-unsigned long aelibCount = 0;
-unsigned long aelibMillis = 0;
+#ifdef LOOP_STATS
+struct AELibStats {
+  const char* name;
+  unsigned long count;
+  unsigned long total;
+  unsigned long max;
+  uint16_t buckets[AELIB_StatBuckets];
+};
+
+AELibStats aelibStats[ AELIB_MaxTasks + AELIB_MaxEvents ];
+int aelibStatsCount = 0;
+// Longest time spent outside Loop() (system tasks, WiFi stack) since last report
+unsigned long aelibStall = 0;
+unsigned long aelibLoopEnd = 0;
 #endif
 
-void registerLoop( LOOP loop ) {
-  if( aelibLoopCount < AELIB_MaxLoops ) {
-    aelibLoops[aelibLoopCount] = loop;
-    aelibLoopCount++;
+// Timed tasks ordered as min-heap by due time
+AELibTask aelibTasks[ AELIB_MaxTasks ];
+int aelibTaskCount=0;
+
+AELibEvent aelibEvents[ AELIB_MaxEvents ];
+int aelibEventCount=0;
+
+#ifdef LOOP_STATS
+// Allocate statistics slot for new task. Tasks with the same name share slot,
+// all unnamed tasks share single one
+int aelibStatsSlot( const char* name ) {
+  for( int i=0; i<aelibStatsCount; i++ ) {
+    if( (aelibStats[i].name == name)
+        || ((aelibStats[i].name != NULL) && (name != NULL) && (strcmp( aelibStats[i].name, name ) == 0)) ) return i;
   }
+  if( aelibStatsCount >= AELIB_MaxTasks + AELIB_MaxEvents ) return -1;
+  memset( &aelibStats[aelibStatsCount], 0, sizeof(AELibStats) );
+  aelibStats[aelibStatsCount].name = name;
+  return aelibStatsCount++;
 }
-void Loop() {
- 
-  for(int i=0; i<aelibLoopCount; i++ ) {
-    if( aelibLoops[i] != NULL ) aelibLoops[i]();
+
+void aelibMeasure( int slot, unsigned long us ) {
+  if( slot < 0 ) return;
+  AELibStats* st = &aelibStats[slot];
+  st->count++;
+  st->total += us;
+  if( us > st->max ) st->max = us;
+  int b = 0;
+  while( (us > 1) && (b < AELIB_StatBuckets-1) ) { us >>= 1; b++; }
+  if( st->buckets[b] < 0xFFFF ) st->buckets[b]++;
+}
+
+int loopStatsPart( char* buffer, int part ) {
+  if( part == 0 ) return sprintf( buffer, "{\"stall\":%lu", aelibStall );
+  if( part > aelibStatsCount ) return (part == aelibStatsCount + 1) ? sprintf( buffer, "}" ) : 0;
+  AELibStats* st = &aelibStats[part-1];
+  // p99: upper bound of the bucket where 99% of calls are reached
+  unsigned long limit = st->count - st->count/100;
+  unsigned long n = 0;
+  int b = 0;
+  for( ; b<AELIB_StatBuckets-1; b++ ) {
+    n += st->buckets[b];
+    if( n >= limit ) break;
+  }
+  unsigned long p99 = (b < AELIB_StatBuckets-1) ? (2UL << b) : st->max;
+  if( p99 > st->max ) p99 = st->max;
+  return sprintf( buffer, ",\"%.*s\":[%lu,%lu,%lu,%lu]", AELIB_StatNameLength,
+    (st->name != NULL) ? st->name : "?", st->count, (st->count>0) ? (st->total / st->count) : 0, st->max, p99 );
+}
+
+void loopStatsReset() {
+  aelibStall = 0;
+  for( int i=0; i<aelibStatsCount; i++ ) {
+    const char* name = aelibStats[i].name;
+    memset( &aelibStats[i], 0, sizeof(AELibStats) );
+    aelibStats[i].name = name;
+  }
+}
+#else
+#define aelibStatsSlot( name ) (-1)
+#endif
+
+// Wrap-safe "a is earlier than b"
+bool aelibBefore( unsigned long a, unsigned long b ) {
+  return ((long)(a - b)) < 0;
+}
+
+void aelibPush( AELibTask task ) {
+  if( aelibTaskCount >= AELIB_MaxTasks ) return;
+  int i = aelibTaskCount++;
+  while( i>0 ) {
+    int parent = (i-1)/2;
+    if( !aelibBefore( task.due, aelibTasks[parent].due ) ) break;
+    aelibTasks[i] = aelibTasks[parent];
+    i = parent;
   }
+  aelibTasks[i] = task;
+}
+
+AELibTask aelibPop() {
+  AELibTask top = aelibTasks[0];
+  AELibTask last = aelibTasks[--aelibTaskCount];
+  int i = 0;
+  while( true ) {
+    int child = 2*i+1;
+    if( child >= aelibTaskCount ) break;
+    if( (child+1 < aelibTaskCount) && aelibBefore( aelibTasks[child+1].due, aelibTasks[child].due ) ) child++;
+    if( !aelibBefore( aelibTasks[child].due, last.due ) ) break;
+    aelibTasks[i] = aelibTasks[child];
+    i = child;
+  }
+  if( aelibTaskCount > 0 ) aelibTasks[i] = last;
+  return top;
+}
+
+void scheduleEvery( unsigned long interval, LOOP, const char* name ) {
+  AELibTask task;
+  task.loop = loop;
+  task.interval = interval;
+  task.due = millis();
+  task.stats = aelibStatsSlot( name );
+  aelibPush( task );
+}
+
+void scheduleAt( unsigned long deadline, LOOP, const char* name ) {
+  AELibTask task;
+  task.loop = loop;
+  task.interval = 0;
+  task.due = deadline;
+  task.stats = aelibStatsSlot( name );
+  aelibPush( task );
+}
+
+void scheduleOnEvent( EVENT, LOOP, const char* name ) {
+  if( aelibEventCount < AELIB_MaxEvents ) {
+    aelibEvents[aelibEventCount].event = event;
+    aelibEvents[aelibEventCount].loop = loop;
+    aelibEvents[aelibEventCount].stats = aelibStatsSlot( name );
+    aelibEventCount++;
+  }
+}
+
+void registerLoop( LOOP, const char* name ) {
+  scheduleEvery( AELIB_LoopInterval, loop, name );
+}
+
+// Call task and account its execution time
+void aelibRun( std::function<void()>& loop, int stats ) {
+#ifdef LOOP_STATS
+  unsigned long us = micros();
+  loop();
+  aelibMeasure( stats, micros() - us );
+#else
+  loop();
+#endif
+}
+
+void aelibRunEvents() {
+  for(int i=0; i<aelibEventCount; i++ ) {
+    if( aelibEvents[i].event() ) aelibRun( aelibEvents[i].loop, aelibEvents[i].stats );
+  }
+}
+
+void Loop() {
+#ifdef LOOP_STATS
+  unsigned long us = micros();
+  if( (aelibLoopEnd != 0) && ((unsigned long)(us - aelibLoopEnd) > aelibStall) ) aelibStall = us - aelibLoopEnd;
+#endif
+  aelibRunEvents();
 
-#ifdef ShowLoopTimes
   unsigned long t = millis();
-  if(aelibMillis == 0 ) aelibMillis = t;
-  if( (unsigned long)(t - aelibMillis) > 10000) {
-    aePrint("loop time = ");aePrint( ((double)(millis()-aelibMillis))/((double)aelibCount) ); aePrintln("ms");
-    aelibMillis = t;
-    aelibCount=0;
-  } else {
-    aelibCount++;
-  }
-#endif 
+  while( (aelibTaskCount > 0) && !aelibBefore( t, aelibTasks[0].due ) ) {
+    AELibTask task = aelibPop();
+    if( task.loop != NULL ) aelibRun( task.loop, task.stats );
+    if( task.interval > 0 ) {
+      task.due += task.interval;
+      // Do not try to catch up missed runs
+      if( aelibBefore( task.due, t ) ) task.due = t + task.interval;
+      aelibPush( task );
+    }
+  }
+
+  // Sleep until next deadline, checking event conditions periodically
+  t = millis();
+  unsigned long wait = AELIB_MaxSleep;
+  if( aelibTaskCount > 0 ) {
+    wait = aelibBefore( t, aelibTasks[0].due ) ? (aelibTasks[0].due - t) : 0;
+    if( wait > AELIB_MaxSleep ) wait = AELIB_MaxSleep;
+  }
+  while( wait > 0 ) {
+    unsigned long d = ((aelibEventCount > 0) && (wait > AELIB_EventPoll)) ? AELIB_EventPoll : wait;
+    delay( d );
+    wait -= d;
+    for(int i=0; i<aelibEventCount; i++ ) {
+      if( aelibEvents[i].event() ) wait = 0;
+    }
+  }
+  yield();
+#ifdef LOOP_STATS
+  aelibLoopEnd = micros();
+#endif
 }
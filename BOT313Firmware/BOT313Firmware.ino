@@ -1,7 +1,7 @@
 // ESP-01S module:
 // Board: ESP8266 generic (Chip is ESP8266EX)
 // Crystal is 26MHz
-// Flash size: 1MB, FS:None, OTA:502KB
+// Flash size: 1MB, FS:64KB, OTA:~470KB (top of FS area is used by Storage journal)
 // Erase Flash: ALL content
 
 #include <stdarg.h>
@@ -9,52 +9,31 @@
 #include "Storage.h"
 #include "Comms.h"
 #include "Thermostat.h"
+#include "History.h"
 
 #ifdef USE_HTU21D
   #include <Wire.h>
-  #include "tah_htu21d.h"
+  #include "TAH_HTU21D.h"
 #endif
 
-static char* TOPIC_State PROGMEM = "State";
+#ifdef THERM_SEND_COMMAND
 static char* TOPIC_SendCommand PROGMEM = "SendCommand";
+#endif
 
 
 //*****************************************************************************************
 // MQTT support
 //*****************************************************************************************
-void mqttConnect() {
-#ifdef THERM_SEND_COMMAND  
-  mqttSubscribeTopic( TOPIC_SendCommand );
-#endif
-}
-
-bool mqttCallback(char* topic, byte* payload, unsigned int length) {
-  //printf("mqttCallback(\"%s\", %u, %u )\r\n", topic, payload, length);
-  //char s[63];
-  //print("Payload=");
-  //if( payload != NULL ) { println( (char*)payload ); } else { println( "empty" );}
-  
 #ifdef THERM_SEND_COMMAND
-  if( mqttIsTopic( topic, TOPIC_SendCommand ) ) {
-    if( (payload != NULL) && (length > 0) && (length<250) ) {
-      char b[255];
-      memset( b, 0, sizeof(b) );
-      strncpy( b, ((char*)payload), length );
-      thermSendMessage( b );
-    }
-    return true;
+void mqttOnSendCommand( byte* payload, unsigned int length ) {
+  if( (payload != NULL) && (length > 0) && (length<250) ) {
+    char b[255];
+    memset( b, 0, sizeof(b) );
+    strncpy( b, ((char*)payload), length );
+    thermSendMessage( b );
   }
-#endif  
-  return false;
-}
-
-void publishState() {
-  if( !mqttConnected() ) return;
-
-  unsigned long t=millis();
-  char s[127];
-
 }
+#endif
 
 
 //*****************************************************************************************
@@ -73,14 +52,17 @@ void setup() {
   Wire.begin(SDA_Pin, SCL_Pin);
   tahInit();
 #endif
-  mqttRegisterCallbacks( mqttCallback, mqttConnect );
+#ifdef THERM_SEND_COMMAND
+  mqttRegisterTopic( TOPIC_SendCommand, mqttOnSendCommand );
+#endif
 
   thermInit();
+#ifdef USE_HISTORY
+  historyInit();
+#endif
   //commsEnableOTA();
 }
 
 void loop() {
   Loop();
-  publishState();
-  delay(10);
 }
@@ -42,9 +42,15 @@
 #define COMMS_ConnectAttempts 1000000
 // Time to wait between RSSI reports
 #define COMMS_RSSITimeout ((unsigned long)(60 * 1000))
+// Time between loop statistics reports
+#define COMMS_StatsInterval ((unsigned long)(60 * 1000))
+
+// MQTT client and OTA servicing period
+#define COMMS_LoopInterval ((unsigned long)10)
 
 #define MQTT_ActivityTimeout ((unsigned long)(10 * 1000))
 #define MQTT_CbsSize 10
+#define MQTT_TopicsSize 32
 #define MQTT_ClientId 16
 #define MQTT_RootSize 32
 #define COMMS_StorageId 'C'
@@ -60,6 +66,9 @@ static char* TOPIC_Activity PROGMEM = "Activity";
 static char* TOPIC_Reset PROGMEM = "Reset";
 static char* TOPIC_FactoryReset PROGMEM = "FactoryReset";
 static char* TOPIC_EnableOTA PROGMEM = "EnableOTA";
+#ifdef LOOP_STATS
+static char* TOPIC_LoopStats PROGMEM = "Stats/Loop";
+#endif
 #ifndef WIFI_HostName
 static char* TOPIC_SetName PROGMEM = "SetName";
 #endif
@@ -98,6 +107,10 @@ bool otaShouldInit;
 unsigned int otaProgress;
 
 unsigned long mqttActivity;
+// Expanded MQTT root with trailing "/", see mqttUpdateRoot()
+char mqttRootPrefix[MQTT_RootSize*3];
+int mqttRootLen = 0;
+void mqttUpdateRoot();
 bool mqttDisableCallback = false;
 char mqttServerAddress[32]="";
 
@@ -109,9 +122,18 @@ struct MQTTCallbacks {
   MQTT_CONNECT;
 };
 
-unsigned int mqttCbsCount=0;
+int mqttCbsCount=0;
 MQTTCallbacks mqttCbs[MQTT_CbsSize];
 
+struct MQTTTopicHandler {
+  char* name;
+  MQTT_TOPIC_CALLBACK;
+};
+
+int mqttTopicsCount=0;
+MQTTTopicHandler mqttTopics[MQTT_TopicsSize];
+bool mqttTopicsSorted = false;
+
 //**************************************************************************
 //                          WIFI helper functions
 //**************************************************************************
@@ -169,6 +191,7 @@ void commsConnect() {
   if( strlen(commsConfig.mqttRoot)<=0 ) {
     strcpy( commsConfig.mqttRoot, "new/%s/" );
   }
+  mqttUpdateRoot();
   storageSave();
 
   WiFi.hostname(commsConfig.hostName);
@@ -203,18 +226,27 @@ char* mqttTopic( char* buffer, char* TOPIC_Name ) {
 char* mqttTopic( char* buffer, char* TOPIC_Name, char* topicVar ) {
   return mqttTopic( buffer, TOPIC_Name, topicVar, NULL );
 }
-char* mqttTopic( char* buffer, char* TOPIC_Name, char* topicVar1, char* topicVar2 ) {
-  char fstr[64]; // format string
-  char empty[2] = ""; // to replace NULL variables
-  
-  sprintf( fstr, commsConfig.mqttRoot, commsConfig.hostName );
+// Expand commsConfig.mqttRoot with device name once. Should be called whenever root or name changed
+void mqttUpdateRoot() {
+  sprintf( mqttRootPrefix, commsConfig.mqttRoot, commsConfig.hostName );
+  mqttRootLen = strlen( mqttRootPrefix );
   // Append "/" to the end of path
-  if( fstr[strlen(fstr)-1] != '/' ) strcat( fstr, "/" );
+  if( (mqttRootLen == 0) || (mqttRootPrefix[mqttRootLen-1] != '/') ) {
+    mqttRootPrefix[mqttRootLen++] = '/';
+    mqttRootPrefix[mqttRootLen] = 0;
+  }
+}
+
+char* mqttTopic( char* buffer, char* TOPIC_Name, char* topicVar1, char* topicVar2 ) {
   // Delete "/" from the TOPIC_Name beginning
   while( (*TOPIC_Name) == '/' ) TOPIC_Name++;
-  
-  strcat( fstr, TOPIC_Name );
-  sprintf( buffer, fstr, (topicVar1!=NULL) ? topicVar1 : empty, (topicVar2!=NULL) ? topicVar2 : empty );
+
+  memcpy( buffer, mqttRootPrefix, mqttRootLen );
+  if( (topicVar1 == NULL) && (topicVar2 == NULL) ) {
+    strcpy( buffer + mqttRootLen, TOPIC_Name );
+  } else {
+    sprintf( buffer + mqttRootLen, TOPIC_Name, (topicVar1!=NULL) ? topicVar1 : "", (topicVar2!=NULL) ? topicVar2 : "" );
+  }
   return( buffer );
 }
 
@@ -261,7 +293,7 @@ bool mqttPublish( char* TOPIC_Name, char* topicVar1, char* topicVar2, long value
 
 bool mqttPublishRaw( char* topic, long value, bool retained ) {
   char sValue[32];
-  sprintf( sValue, "%u", value );
+  sprintf( sValue, "%lu", (unsigned long)value );
   return mqttPublishRaw( topic, sValue, retained );
 }
 
@@ -284,6 +316,20 @@ bool mqttPublishRaw( char* topic, char* value, bool retained ) {
   return mqttClient.publish( topic, value, retained );
 }
 
+bool mqttPublishBegin( char* TOPIC_Name, unsigned int length, bool retained ) {
+  if( !mqttConnected() ) return false;
+  char topic[63];
+  return mqttClient.beginPublish( mqttTopic( topic, TOPIC_Name ), length, retained );
+}
+
+bool mqttPublishWrite( const uint8_t* data, unsigned int length ) {
+  return mqttClient.write( data, length ) == length;
+}
+
+bool mqttPublishEnd() {
+  return mqttClient.endPublish() == 1;
+}
+
 void triggerActivity() {
   mqttActivity = millis();
 }
@@ -296,54 +342,109 @@ void mqttRegisterCallbacks( MQTT_CALLBACK, MQTT_CONNECT ) {
   mqttCbsCount++;
 }
 
-// Internal proxy function to process "default" topics
+void mqttRegisterTopic( char* TOPIC_Name, MQTT_TOPIC_CALLBACK ) {
+  if( mqttTopicsCount >= MQTT_TopicsSize ) return;
+  while( (*TOPIC_Name) == '/' ) TOPIC_Name++;
+  mqttTopics[mqttTopicsCount].name = TOPIC_Name;
+  mqttTopics[mqttTopicsCount].callback = callback;
+  mqttTopicsCount++;
+  mqttTopicsSorted = false;
+}
+
+// Sort topic handlers by name (stable, so handlers of the same topic keep registration order)
+void mqttSortTopics() {
+  if( mqttTopicsSorted ) return;
+  for( int i=1; i<mqttTopicsCount; i++ ) {
+    MQTTTopicHandler h = mqttTopics[i];
+    int j = i-1;
+    while( (j>=0) && (strcmp( mqttTopics[j].name, h.name ) > 0) ) {
+      mqttTopics[j+1] = mqttTopics[j];
+      j--;
+    }
+    mqttTopics[j+1] = h;
+  }
+  mqttTopicsSorted = true;
+}
+
+// Call all handlers registered for topic name (topic without device root)
+bool mqttDispatch( char* name, byte* payload, unsigned int length ) {
+  mqttSortTopics();
+  // Binary search for the first handler with matching name
+  int lo = 0;
+  int hi = mqttTopicsCount;
+  while( lo < hi ) {
+    int mid = (lo + hi) / 2;
+    if( strcmp( mqttTopics[mid].name, name ) < 0 ) lo = mid + 1; else hi = mid;
+  }
+  bool found = false;
+  for( ; (lo < mqttTopicsCount) && (strcmp( mqttTopics[lo].name, name ) == 0); lo++ ) {
+    found = true;
+    if( mqttTopics[lo].callback != NULL ) mqttTopics[lo].callback( payload, length );
+  }
+  return found;
+}
+
+// Internal proxy function to dispatch incoming messages
 void mqttCallbackProxy(char* topic, byte* payload, unsigned int length) {
   if( mqttDisableCallback ) return;
 
+  if( (strncmp( topic, mqttRootPrefix, mqttRootLen ) == 0) && mqttDispatch( topic + mqttRootLen, payload, length ) ) return;
+
   for(int i=0; i<mqttCbsCount; i++ ) {
     if( mqttCbs[i].callback != NULL ) {
       if( mqttCbs[i].callback( topic, payload, length) ) return;
     }
   }
+}
 
-  if( mqttIsTopic( topic, TOPIC_Reset ) ) {
-    aePrintln(F("MQTT: Resetting by request"));
-    commsClearTopicAndRestart( TOPIC_Reset );
-  } else if( mqttIsTopic( topic, TOPIC_FactoryReset ) ) {
-    aePrintln(F("MQTT: Resetting settings"));
-    storageReset();
-    commsClearTopicAndRestart( TOPIC_FactoryReset );
+//**************************************************************************
+//                        Default topics handlers
+//**************************************************************************
+void mqttOnReset( byte* payload, unsigned int length ) {
+  aePrintln(F("MQTT: Resetting by request"));
+  commsClearTopicAndRestart( TOPIC_Reset );
+}
+
+void mqttOnFactoryReset( byte* payload, unsigned int length ) {
+  aePrintln(F("MQTT: Resetting settings"));
+  storageReset();
+  commsClearTopicAndRestart( TOPIC_FactoryReset );
+}
 
 #ifndef WIFI_HostName
-  } else if( mqttIsTopic( topic, TOPIC_SetName ) ) {
-    if( (payload != NULL) && (length > 1) && (length<32) ) {
-      char topic[63];
-      mqttTopic(topic, TOPIC_Online);
-      memset( commsConfig.hostName, 0, sizeof(commsConfig.hostName) );
-      strncpy( commsConfig.hostName, ((char*)payload), length );
-      aePrint(F("MQTT: Device name set to ")); aePrintln(commsConfig.hostName);
-      
-      mqttPublishRaw( topic, (long)0, true );
-      commsClearTopicAndRestart( TOPIC_SetName );
-    }
+void mqttOnSetName( byte* payload, unsigned int length ) {
+  if( (payload != NULL) && (length > 1) && (length<32) ) {
+    char topic[63];
+    mqttTopic(topic, TOPIC_Online);
+    memset( commsConfig.hostName, 0, sizeof(commsConfig.hostName) );
+    strncpy( commsConfig.hostName, ((char*)payload), length );
+    mqttUpdateRoot();
+    aePrint(F("MQTT: Device name set to ")); aePrintln(commsConfig.hostName);
+    
+    mqttPublishRaw( topic, (long)0, true );
+    commsClearTopicAndRestart( TOPIC_SetName );
+  }
+}
 #endif
+
 #ifndef MQTT_Root
-  } else if( mqttIsTopic( topic, TOPIC_SetRoot ) ) {
-    if( (payload != NULL) && (length > 3) && (length<63) ) {
-      char topic[63];
-      mqttTopic(topic, TOPIC_Online);
-      strncpy( commsConfig.mqttRoot, ((char*)payload),length);
-      commsConfig.mqttRoot[length]=0;
-      aePrint(F("MQTT: Device root set to ")); aePrintln(commsConfig.mqttRoot);
-      storageSave();
-      mqttPublishRaw( topic, (long)0, true );
-      commsClearTopicAndRestart( TOPIC_SetRoot );
-    }
-#endif
-  } else if( mqttIsTopic( topic, TOPIC_EnableOTA ) ) {
-    commsEnableOTA();
+void mqttOnSetRoot( byte* payload, unsigned int length ) {
+  if( (payload != NULL) && (length > 3) && (length<63) ) {
+    char topic[63];
+    mqttTopic(topic, TOPIC_Online);
+    strncpy( commsConfig.mqttRoot, ((char*)payload),length);
+    commsConfig.mqttRoot[length]=0;
+    mqttUpdateRoot();
+    aePrint(F("MQTT: Device root set to ")); aePrintln(commsConfig.mqttRoot);
+    storageSave();
+    mqttPublishRaw( topic, (long)0, true );
+    commsClearTopicAndRestart( TOPIC_SetRoot );
   }
-  
+}
+#endif
+
+void mqttOnEnableOTA( byte* payload, unsigned int length ) {
+  commsEnableOTA();
 }
 
 //**************************************************************************
@@ -436,6 +537,22 @@ void commsLoop() {
         }
       }
 
+#ifdef LOOP_STATS
+      static unsigned long statsReported = 0;
+      if( (unsigned long)(t - statsReported) > COMMS_StatsInterval ) {
+        char s[LOOP_StatsPartSize];
+        unsigned int length = 0;
+        int len;
+        for( int part=0; (len = loopStatsPart( s, part )) > 0; part++ ) length += len;
+        if( mqttPublishBegin( TOPIC_LoopStats, length, false ) ) {
+          bool ok = true;
+          for( int part=0; ok && ((len = loopStatsPart( s, part )) > 0); part++ ) ok = mqttPublishWrite( (uint8_t*)s, len );
+          if( mqttPublishEnd() && ok ) loopStatsReset();
+        }
+        statsReported = t;
+      }
+#endif
+
       // Report online status every 10 minutes
       if( (unsigned long)(t - onlineReported) > ((unsigned long)600000) ) {
         onlineReported = t;
@@ -501,17 +618,12 @@ void commsLoop() {
             tzset();
 #endif  
           
-          // Subscribe
-          mqttSubscribeTopic( TOPIC_Reset );
-          mqttSubscribeTopic( TOPIC_FactoryReset );
-          mqttSubscribeTopic( TOPIC_EnableOTA );
-#ifndef WIFI_HostName
-          mqttSubscribeTopic( TOPIC_SetName );
-#endif  
-
-#ifndef MQTT_Root
-          mqttSubscribeTopic( TOPIC_SetRoot );
-#endif  
+          // Subscribe registered topics
+          mqttSortTopics();
+          for(int i=0; i<mqttTopicsCount; i++ ) {
+            if( (i>0) && (strcmp( mqttTopics[i].name, mqttTopics[i-1].name ) == 0) ) continue;
+            mqttSubscribeTopic( mqttTopics[i].name );
+          }
           mqttPublish( TOPIC_Online, (long)1, true );
           onlineReported = t;
 #ifdef VERSION
@@ -609,6 +721,16 @@ void commsInit() {
   commsPaused = 0;
   mqttActivity = 0;
   storageRegisterBlock( COMMS_StorageId, &commsConfig, sizeof(commsConfig) );
+
+  mqttRegisterTopic( TOPIC_Reset, mqttOnReset );
+  mqttRegisterTopic( TOPIC_FactoryReset, mqttOnFactoryReset );
+  mqttRegisterTopic( TOPIC_EnableOTA, mqttOnEnableOTA );
+#ifndef WIFI_HostName
+  mqttRegisterTopic( TOPIC_SetName, mqttOnSetName );
+#endif
+#ifndef MQTT_Root
+  mqttRegisterTopic( TOPIC_SetRoot, mqttOnSetRoot );
+#endif
 #ifdef WIFI_HostName
   uint8_t macAddr[6];
   char macS[16];
@@ -620,7 +742,8 @@ void commsInit() {
 #ifdef MQTT_Root
   strcpy( commsConfig.mqttRoot, MQTT_Root );
 #endif  
+  mqttUpdateRoot();
   
   commsConnect();
-  registerLoop(commsLoop);
+  scheduleEvery( COMMS_LoopInterval, commsLoop, "comms" );
 }
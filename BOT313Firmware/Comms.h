@@ -1,12 +1,12 @@
 #ifndef comms_h
 #define comms_h
 
-#ifndef std::function
 #include <functional>
-#endif
+#include <time.h>
 
 #define MQTT_CALLBACK std::function<bool(char*, uint8_t*, unsigned int)> callback
 #define MQTT_CONNECT std::function<void()> connect
+#define MQTT_TOPIC_CALLBACK std::function<void(uint8_t*, unsigned int)> callback
 
 // Exported functions:
 // WiFi
@@ -43,6 +43,12 @@ bool mqttPublish( char* TOPIC_Name, char* value, bool retained );
 bool mqttPublish( char* TOPIC_Name, char* topicVar, char* value, bool retained );
 bool mqttPublish( char* TOPIC_Name, char* topicVar1, char* topicVar2, char* value, bool retained );
 
+// Streamed publishing of payloads larger than MQTT buffer: length bytes in total are to be
+// written with mqttPublishWrite() calls between mqttPublishBegin() and mqttPublishEnd()
+bool mqttPublishBegin( char* TOPIC_Name, unsigned int length, bool retained );
+bool mqttPublishWrite( const uint8_t* data, unsigned int length );
+bool mqttPublishEnd();
+
 // RAW topic names (no templating)
 void mqttSubscribeTopicRaw( char* topic );
 bool mqttPublishRaw( char* topic, long value, bool retained );
@@ -53,6 +59,12 @@ void triggerActivity();
 
 void mqttRegisterCallbacks( MQTT_CALLBACK, MQTT_CONNECT );
 
+// Register handler for TOPIC_Name (no template variables allowed).
+// Topic is subscribed on every connect and incoming messages are dispatched by 
+// device root prefix check and single lookup in sorted topics table.
+// Several handlers may be registered for the same topic, they are called in registration order
+void mqttRegisterTopic( char* TOPIC_Name, MQTT_TOPIC_CALLBACK );
+
 bool commsOTAEnabled();
 void commsEnableOTA();
 
@@ -10,6 +10,19 @@
 //#define THERM_DEBUG
 // Define this to enable SendCommand topic
 //#define THERM_SEND_COMMAND
+// State publishing mode:
+//   0: every value is published to its own retained topic
+//   1: changed values are published as single JSON document to "State" topic
+//   2: both
+#define THERM_PUBLISH_MODE 0
+// Define this to replace thermostat MCU with built-in simulator (see ThermSimulator.h for
+// reply latency, jitter, byte drop and CRC corruption settings)
+//#define THERM_SIMULATOR
+// Define this to enable RunBenchmark topic: measures parser, publishing, dispatch and CRC
+// on device and publishes results to Stats/Bench
+//#define THERM_BENCHMARK
+// Define this to calculate CRC bit by bit instead of using 512 bytes lookup table in flash
+//#define THERM_CRC_BITWISE
 
 #define LED_Pin 2
 
@@ -28,6 +41,16 @@
 
 // Define this to use external THU21D based sensor (temperature & humidity)
 //#define USE_HTU21D
+// HTU21D readings filter: median window (odd, 1 to disable), weight of new median in
+// moving average (1 to disable) and changes to be published
+//#define TAH_MedianSize 3
+//#define TAH_EmaWeight 0.3
+//#define TAH_TemperatureDeadband 0.55
+//#define TAH_HumidityDeadband 1.4
+
+// Define this to keep history of readings in RAM and publish it to History topic
+// on GetHistory request and after MQTT reconnect
+//#define USE_HISTORY
 
 // Define this to autosynchronize time if NTP server is available.
 // Check "tz.h" for timezone constants
@@ -60,9 +83,33 @@
 #endif
 
 
-#define LOOP std::function<void()>
+#define LOOP std::function<void()> loop
+#define EVENT std::function<bool()> event
+
+// Define this to collect per task execution times and publish them to Stats/Loop topic
+//#define LOOP_STATS
 
-void registerLoop( LOOP loop );
+// Cooperative scheduler. Optional task name is used in loop statistics
+// Call loop every AELIB_LoopInterval ms
+void registerLoop( LOOP, const char* name = NULL );
+// Call loop every interval ms
+void scheduleEvery( unsigned long interval, LOOP, const char* name = NULL );
+// Call loop once when millis() reaches deadline
+void scheduleAt( unsigned long deadline, LOOP, const char* name = NULL );
+// Call loop as soon as event() returns true (e.g. UART data available)
+void scheduleOnEvent( EVENT, LOOP, const char* name = NULL );
+// Run due tasks and sleep until the next deadline or event
 void Loop();
 
+#ifdef LOOP_STATS
+// Loop statistics collected since last reset as JSON:
+// {"stall":<us>,"<task>":[<calls>,<avg us>,<max us>,<p99 us>],...}
+// Document is too long for single MQTT packet, so it is printed part by part: part 0 is
+// header, then one part per task and closing bracket. Returns length of the part printed
+// into buffer of LOOP_StatsPartSize bytes, 0 past the last part
+#define LOOP_StatsPartSize 80
+int loopStatsPart( char* buffer, int part );
+void loopStatsReset();
+#endif
+
 #endif
@@ -0,0 +1,196 @@
+#include <Arduino.h>
+#include <time.h>
+#include "Config.h"
+#include "Comms.h"
+#include "Thermostat.h"
+#include "History.h"
+
+#ifdef USE_HTU21D
+  #include "TAH_HTU21D.h"
+#endif
+
+#ifdef USE_HISTORY
+
+static char* TOPIC_GetHistory PROGMEM = "GetHistory";
+static char* TOPIC_History PROGMEM = "History";
+
+// Ring buffer size, bytes. One reading a minute takes 3..7 bytes
+#ifndef HISTORY_Size
+  #define HISTORY_Size 3072
+#endif
+#define HISTORY_LoopInterval ((unsigned long)1000)
+// Readings are recorded this often (seconds) and on every heating relay switch
+#define HISTORY_Interval 60
+// Max delta records between key records
+#define HISTORY_KeyEvery 64
+
+// Record layout, see History.h
+#define HISTORY_Key 0x80
+#define HISTORY_Epoch 0x40
+#define HISTORY_Sensor 0x02
+#define HISTORY_Heating 0x01
+#define HISTORY_KeySize 11
+// RoomTemp, FloorTemp, TargetTemp, sensor temperature and humidity
+#define HISTORY_Values 5
+
+struct HistorySample {
+  uint8 flags;
+  int16 values[HISTORY_Values];
+};
+
+uint8 historyBuffer[HISTORY_Size];
+uint16 historyTail = 0;
+uint16 historyCount = 0;
+
+// Last recorded sample, delta records are relative to it
+HistorySample historyLast;
+uint32 historyLastTime = 0;
+bool historyLastEpoch = false;
+// Records written since last key record
+int historyRecords = 0;
+bool historyKeyNeeded = true;
+bool historyDumpPending = false;
+// Dump was requested by GetHistory: there is a subscriber to receive it
+bool historyDumpRequested = false;
+
+int historyRecordLength( uint16 pos ) {
+  uint8 header = historyBuffer[pos];
+  if( header & HISTORY_Key ) return HISTORY_KeySize;
+  int len = 2;
+  for( int i=0; i<HISTORY_Values; i++ ) {
+    if( header & (1 << (i+2)) ) len++;
+  }
+  return len;
+}
+
+// Append record to buffer dropping the oldest ones if there is no room
+void historyPush( const uint8* record, int len ) {
+  while( HISTORY_Size - historyCount < len ) {
+    // Buffer should start with key record
+    do {
+      int n = historyRecordLength( historyTail );
+      historyTail = (historyTail + n) % HISTORY_Size;
+      historyCount -= n;
+    } while( (historyCount > 0) && ((historyBuffer[historyTail] & HISTORY_Key) == 0) );
+  }
+  if( (historyCount == 0) && ((record[0] & HISTORY_Key) == 0) ) {
+    historyKeyNeeded = true;
+    return;
+  }
+  for( int i=0; i<len; i++ ) {
+    historyBuffer[(historyTail + historyCount + i) % HISTORY_Size] = record[i];
+  }
+  historyCount += len;
+}
+
+void historySample( HistorySample* s ) {
+  memset( s, 0, sizeof(HistorySample) );
+  s->flags = thermState.heating ? HISTORY_Heating : 0;
+  s->values[0] = (int16)(thermState.roomTemp * 2);
+  s->values[1] = (int16)(thermState.floorTemp * 2);
+  s->values[2] = (int16)(thermState.targetTemp * 2);
+#ifdef USE_HTU21D
+  if( tahAvailable() ) {
+    float t = tahGetTemperature();
+    s->flags |= HISTORY_Sensor;
+    s->values[3] = (int16)(t * 10 + ((t < 0) ? -0.5 : 0.5));
+    s->values[4] = (int16)(tahGetHumidity() * 2);
+  }
+#endif
+}
+
+// Publish whole buffer as single message. Buffer is emptied only when publishing
+// requested by GetHistory completes: nobody may be subscribed after reconnect
+void historyDump() {
+  bool reset = historyDumpRequested;
+  historyDumpPending = false;
+  historyDumpRequested = false;
+  if( historyCount == 0 ) return;
+  static const uint8 magic[2] = { 'H', '1' };
+  if( !mqttPublishBegin( TOPIC_History, sizeof(magic) + historyCount, false ) ) return;
+  // Buffer content may wrap around its end
+  uint16 first = HISTORY_Size - historyTail;
+  if( first > historyCount ) first = historyCount;
+  bool ok = mqttPublishWrite( magic, sizeof(magic) )
+    && mqttPublishWrite( &historyBuffer[historyTail], first )
+    && ((first == historyCount) || mqttPublishWrite( historyBuffer, historyCount - first ));
+  if( mqttPublishEnd() && ok && reset ) {
+    historyTail = 0;
+    historyCount = 0;
+    historyKeyNeeded = true;
+  }
+}
+
+void historyLoop() {
+  if( historyDumpPending && mqttConnected() ) historyDump();
+
+  if( !thermAvailable() ) {
+    historyKeyNeeded = true;
+    return;
+  }
+  bool epoch = commsTimeIsValid();
+  uint32 now = epoch ? (uint32)time(nullptr) : (uint32)(millis() / 1000);
+  uint32 dt = now - historyLastTime;
+  HistorySample s;
+  historySample( &s );
+  bool heatingChanged = ((s.flags ^ historyLast.flags) & HISTORY_Heating) != 0;
+  if( !historyKeyNeeded && !heatingChanged && (dt < HISTORY_Interval) ) return;
+
+  uint8 record[HISTORY_KeySize];
+  int len = 0;
+  bool key = historyKeyNeeded || (epoch != historyLastEpoch) || (dt > 255)
+    || (((s.flags ^ historyLast.flags) & HISTORY_Sensor) != 0) || (historyRecords >= HISTORY_KeyEvery);
+  if( !key ) {
+    uint8 changed = 0;
+    len = 2;
+    for( int i=0; i<HISTORY_Values; i++ ) {
+      int d = s.values[i] - historyLast.values[i];
+      if( d == 0 ) continue;
+      if( (d < -128) || (d > 127) ) {
+        key = true;
+        break;
+      }
+      changed |= 1 << i;
+      record[len++] = (uint8)(int8)d;
+    }
+    record[0] = (changed << 2) | (s.flags & HISTORY_Heating);
+    record[1] = (uint8)dt;
+  }
+  if( key ) {
+    record[0] = HISTORY_Key | (epoch ? HISTORY_Epoch : 0) | s.flags;
+    for( int i=0; i<4; i++ ) record[1+i] = (uint8)(now >> (i*8));
+    record[5] = (uint8)s.values[0];
+    record[6] = (uint8)s.values[1];
+    record[7] = (uint8)s.values[2];
+    record[8] = (uint8)(s.values[3] & 0xFF);
+    record[9] = (uint8)((uint16)s.values[3] >> 8);
+    record[10] = (uint8)s.values[4];
+    len = HISTORY_KeySize;
+    historyRecords = 0;
+    historyKeyNeeded = false;
+  } else {
+    historyRecords++;
+  }
+  historyPush( record, len );
+  historyLast = s;
+  historyLastTime = now;
+  historyLastEpoch = epoch;
+}
+
+void historyOnGetHistory( byte* payload, unsigned int length ) {
+  historyDumpPending = true;
+  historyDumpRequested = true;
+}
+
+// Publish readings collected while MQTT was not available
+void historyConnect() {
+  historyDumpPending = true;
+}
+
+void historyInit() {
+  mqttRegisterTopic( TOPIC_GetHistory, historyOnGetHistory );
+  mqttRegisterCallbacks( NULL, historyConnect );
+  scheduleEvery( HISTORY_LoopInterval, historyLoop, "history" );
+}
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef history_h
+#define history_h
+#include "Config.h"
+
+// History of thermostat and sensor readings kept in RAM ring buffer.
+// Buffer is published as single binary message to "History" topic on GetHistory
+// request and after MQTT reconnect. It is emptied only once published on request.
+//
+// Message is "H1" followed by records, oldest first. Fixed point values:
+// temperatures reported by MCU are in 0.5C units, sensor temperature in 0.1C,
+// sensor humidity in 0.5% units. Multibyte values are little endian.
+//
+// Key record, 11 bytes:
+//   0:    1 | epoch<<6 | sensor<<1 | heating  (bit 7 is set)
+//           epoch: time is UNIX time, otherwise seconds since boot
+//           sensor: HTU21D values are valid
+//   1..4: time, seconds
+//   5:    RoomTemp, 6: FloorTemp, 7: TargetTemp
+//   8..9: sensor temperature (int16), 10: sensor humidity
+//
+// Delta record, 2 bytes + 1 byte per changed value:
+//   0:    changed<<2 | heating  (bit 7 is clear)
+//           changed: bit mask of values following, 1: RoomTemp, 2: FloorTemp,
+//           4: TargetTemp, 8: sensor temperature, 16: sensor humidity
+//   1:    seconds passed since previous record
+//   2..:  int8 change of every value in the changed mask, in the order above
+//
+// Buffer always starts with key record: when it overflows, the oldest records
+// are dropped up to the next key record.
+
+void historyInit();
+
+#endif
@@ -1,142 +1,514 @@
 #include <Arduino.h>
-#include <EEPROM.h>
 #include "Config.h"
 #include "Storage.h"
 
 //#define Debug
 
+// Storage is kept as append-only journal in a ring of flash sectors.
+// Every save appends only changed blocks as CRC protected records to the active sector.
+// When sector is (almost) full, latest version of all blocks is written into the next
+// sector of the ring ("compaction") which then becomes active.
+// On boot the newest valid record of every block is restored.
+// Blocks are streamed between flash and their own memory through small buffer,
+// no RAM copy of the storage is kept.
+
 #define STORAGE_MaxBlocks 8
-#define STORAGE_SaveDelay ((unsigned long)60*60*1000)
-#define STORAGE_Size 4096
+#define STORAGE_SaveDelay ((unsigned long)10*60*1000)
+#define STORAGE_CheckInterval ((unsigned long)1000)
+
+// Number of flash sectors used by journal. Journal ends with the sector reserved for EEPROM,
+// the others are taken from the top of file system area (board setting "FS:64KB" or larger).
+// Without FS area OTA image is written right below EEPROM and only that sector is used:
+// compaction then erases the only copy of the settings.
+#define STORAGE_Sectors 2
+#define STORAGE_SectorSize 4096
+// Max size of single block
+#define STORAGE_MaxBlockSize 256
+// Compact in background when active sector is filled above this offset
+#define STORAGE_CompactThreshold (STORAGE_SectorSize*3/4)
+// Flash read/write buffer size, should be multiple of 4
+#define STORAGE_BufferSize 32
+
+#define STORAGE_SectorMagic 0x314A4541
+#define STORAGE_RecordMagic 0x4541
+
+extern "C" uint32_t _FS_start;
+extern "C" uint32_t _FS_end;
+extern "C" uint32_t _EEPROM_start;
+#define STORAGE_FirstSector ((((uintptr_t)&_EEPROM_start - 0x40200000) / STORAGE_SectorSize) - storageSectors + 1)
 
-unsigned int storageBlockCount;
+// Number of journal sectors available with flash layout in use
+int storageSectors = 1;
+
+int storageBlockCount;
 char storageIds[STORAGE_MaxBlocks];
 unsigned short storageSizes[STORAGE_MaxBlocks];
 void* storageBlocks[STORAGE_MaxBlocks];
+// Hash of block content at the moment of last change detection
+uint32_t storageHashes[STORAGE_MaxBlocks];
+// Block changed since it was written to journal
+bool storageDirty[STORAGE_MaxBlocks];
+
+struct StorageSectorHeader {
+  uint32_t magic;
+  uint32_t generation;
+};
 
+struct StorageRecordHeader {
+  uint16_t magic;
+  char id;
+  uint8_t reserved;
+  uint16_t size;
+  uint16_t crc;
+};
 
+// Snapshot format used by EEPROM based firmware
 struct StorageSnapshotHeader {
   char id;
   unsigned short size;
 } __attribute__ ((packed));
 
-byte storageSnapshot[STORAGE_Size];
+// Location of latest valid record of every block found in active sector on boot
+struct StorageRecord {
+  char id;
+  unsigned short offset;
+  unsigned short size;
+};
+StorageRecord storageRecords[STORAGE_MaxBlocks];
+int storageRecordCount = 0;
+
+// Aligned buffer to read and write flash
+uint32_t storageBuffer[STORAGE_BufferSize / 4];
+uint32_t storageWriteAddress;
+int storageWriteLen;
+bool storageWriteOk;
+
+// Journal position
+int storageSector = 0;
+uint32_t storageGeneration = 0;
+unsigned short storageOffset = 0;
+bool storageMustCompact = false;
 
 unsigned long changedOn = 0;
 
-// Search block of data in snapshot by blockId
-// Returns byte index in storageSnapshot array or -1 if not found
-void* storageSnapshotFind(char id ) {
-  if( (storageSnapshot[0] == 0x41) && (storageSnapshot[1] == 0x45) ) {
-    byte* p = storageSnapshot + 2;
-    while( p < (storageSnapshot + STORAGE_Size) ) {
-      StorageSnapshotHeader* header = (StorageSnapshotHeader*)p;
-      p += sizeof(StorageSnapshotHeader);
-      
-      if( header->id == 0 ) return NULL;
-      if( header->id == id ) return p;
-      
-      p += header->size;
-    }
+//**************************************************************************
+//                            Change detection
+//**************************************************************************
+// FNV-1a hash of block content
+uint32_t storageHash( const void* data, unsigned short size ) {
+  uint32_t hash = 2166136261UL;
+  for( int i=0; i<size; i++ ) {
+    hash = (hash ^ ((const byte*)data)[i]) * 16777619UL;
   }
-  return NULL;
+  return hash;
 }
 
-// Pack Storage blocks into storageSnapshot array to write to EMMC;
-void storageMakeSnapshot(){
-  memset( storageSnapshot, 0, STORAGE_Size );
-  storageSnapshot[0] = 0x41; storageSnapshot[1] = 0x45;
+// Mark block for writing
+void storageUpdate( int i ) {
+  storageDirty[i] = true;
+  if( changedOn == 0 ) changedOn = millis();
+}
 
-  byte* p = &storageSnapshot[2];
-  for( int i = 0; (i<storageBlockCount) && (p<(storageSnapshot+STORAGE_Size)); i++) {
-    StorageSnapshotHeader* header = (StorageSnapshotHeader*)p;
-    p+=sizeof(StorageSnapshotHeader);
-    header->id = storageIds[i];
-    header->size = storageSizes[i];
-    // Should implement range checking here
-    //if( (p+header->size) >= STORAGE_Size ) header->size = STORAGE_Size - p - 1;
-    
-    memcpy( p, storageBlocks[i], header->size );
-    p += header->size;
+void storageMarkDirty( char id ) {
+  for( int i = 0; (i<storageBlockCount); i++) {
+    if( storageIds[i] == id ) {
+      storageHashes[i] = storageHash( storageBlocks[i], storageSizes[i] );
+      storageUpdate( i );
+    }
   }
 }
 
 bool isChanged() {
-  bool changed = false;
   for( int i = 0; (i<storageBlockCount); i++) {
-    void* p = storageSnapshotFind( storageIds[i] );
-    if( (p != NULL) && (memcmp( storageBlocks[i], p, storageSizes[i] ) != 0 ) ) changed = true;
-  }
-  if( changed ) {
+    uint32_t hash = storageHash( storageBlocks[i], storageSizes[i] );
+    if( hash != storageHashes[i] ) {
 #ifdef Debug
-  aePrintln(F("Storage: changes detected"));
+      aePrintf("Storage: block %c changed\n", storageIds[i]);
 #endif
-    storageMakeSnapshot();
-    changedOn = millis();
+      storageHashes[i] = hash;
+      storageUpdate( i );
+    }
   }
   return (changedOn>0);
 }
 
-// Read storage from non-volatile memory
+//**************************************************************************
+//                            Flash access
+//**************************************************************************
+uint16_t storageCRC( const byte* data, int len, uint16_t crc ) {
+  for( int i=0; i<len; i++ ) {
+    crc ^= data[i];
+    for( int b=0; b<8; b++ ) {
+      crc = (crc & 0x0001) ? ((crc >> 1) ^ 0xA001) : (crc >> 1);
+    }
+  }
+  return crc;
+}
+
+uint32_t storageAddress( int sector, unsigned short offset ) {
+  return (STORAGE_FirstSector + sector) * STORAGE_SectorSize + offset;
+}
+
+// Read flash into memory, neither address nor length need to be aligned.
+// Uses own buffer so it may be called between buffered writes.
+bool storageFlashRead( uint32_t address, void* data, int len ) {
+  uint32_t buffer[STORAGE_BufferSize / 4];
+  byte* p = (byte*)data;
+  while( len > 0 ) {
+    int skip = address & 3;
+    int n = STORAGE_BufferSize - skip;
+    if( n > len ) n = len;
+    if( !ESP.flashRead( address - skip, buffer, (skip + n + 3) & ~3 ) ) return false;
+    memcpy( p, ((byte*)buffer) + skip, n );
+    address += n; p += n; len -= n;
+  }
+  return true;
+}
+
+// Calculate CRC of flash area
+bool storageFlashCRC( uint32_t address, int len, uint16_t* crc ) {
+  byte chunk[16];
+  while( len > 0 ) {
+    int n = (len > (int)sizeof(chunk)) ? sizeof(chunk) : len;
+    if( !storageFlashRead( address, chunk, n ) ) return false;
+    *crc = storageCRC( chunk, n, *crc );
+    address += n; len -= n;
+  }
+  return true;
+}
+
+// Buffered sequential write starting at aligned address
+void storageWriteBegin( uint32_t address ) {
+  storageWriteAddress = address;
+  storageWriteLen = 0;
+  storageWriteOk = true;
+}
+
+bool storageWriteFlush() {
+  if( storageWriteLen > 0 ) {
+    int n = (storageWriteLen + 3) & ~3;
+    memset( ((byte*)storageBuffer) + storageWriteLen, 0xFF, n - storageWriteLen );
+    if( !ESP.flashWrite( storageWriteAddress, storageBuffer, n ) ) storageWriteOk = false;
+    storageWriteAddress += n;
+    storageWriteLen = 0;
+  }
+  return storageWriteOk;
+}
+
+void storageWrite( const void* data, int len ) {
+  const byte* p = (const byte*)data;
+  while( len > 0 ) {
+    int n = STORAGE_BufferSize - storageWriteLen;
+    if( n > len ) n = len;
+    memcpy( ((byte*)storageBuffer) + storageWriteLen, p, n );
+    storageWriteLen += n; p += n; len -= n;
+    if( storageWriteLen == STORAGE_BufferSize ) storageWriteFlush();
+  }
+}
+
+//**************************************************************************
+//                            Journal
+//**************************************************************************
+int storageRecordSize( unsigned short size ) {
+  return (sizeof(StorageRecordHeader) + size + 3) & ~3;
+}
+
+// Erase sector and make it active. Sector header is written by storageCloseSector
+// once all records are in place
+bool storageFormatSector( int sector ) {
+  // Records of erased sector are dropped, storageCompact copies the ones still needed
+  storageRecordCount = 0;
+  storageSector = sector;
+  storageOffset = sizeof(StorageSectorHeader);
+  return ESP.flashEraseSector( STORAGE_FirstSector + sector );
+}
+
+// Write header of active sector: sector with the newest generation is used on boot
+bool storageCloseSector( uint32_t generation ) {
+  StorageSectorHeader header;
+  header.magic = STORAGE_SectorMagic;
+  header.generation = generation;
+  storageWriteBegin( storageAddress( storageSector, 0 ) );
+  storageWrite( &header, sizeof(header) );
+  if( !storageWriteFlush() ) return false;
+  storageGeneration = generation;
+  return true;
+}
+
+// Append current content of the block to active sector
+bool storageAppend( int i ) {
+  unsigned short size = storageSizes[i];
+  int recordSize = storageRecordSize( size );
+  if( (size > STORAGE_MaxBlockSize) || (storageOffset + recordSize > STORAGE_SectorSize) ) return false;
+
+  StorageRecordHeader header;
+  header.magic = STORAGE_RecordMagic;
+  header.id = storageIds[i];
+  header.reserved = 0;
+  header.size = size;
+  header.crc = storageCRC( (byte*)storageBlocks[i], size, storageCRC( (byte*)&header.id, 4, 0xFFFF ) );
+
+  storageWriteBegin( storageAddress( storageSector, storageOffset ) );
+  storageWrite( &header, sizeof(header) );
+  storageWrite( storageBlocks[i], size );
+  if( !storageWriteFlush() ) {
+    storageMustCompact = true;
+    return false;
+  }
+  storageOffset += recordSize;
+  storageDirty[i] = false;
+  return true;
+}
+
+bool storageRegistered( char id ) {
+  for( int i = 0; (i<storageBlockCount); i++) {
+    if( storageIds[i] == id ) return true;
+  }
+  return false;
+}
+
+// Records of blocks which are not registered (yet) have to survive compaction
+bool storageCanCompact() {
+  if( storageSectors > 1 ) return true;
+  for( int r = 0; r < storageRecordCount; r++ ) {
+    if( !storageRegistered( storageRecords[r].id ) ) return false;
+  }
+  return true;
+}
+
+// Space taken by latest version of all blocks in compacted sector
+int storageJournalSize() {
+  int size = sizeof(StorageSectorHeader);
+  for( int i = 0; (i<storageBlockCount); i++) size += storageRecordSize( storageSizes[i] );
+  for( int r = 0; r < storageRecordCount; r++ ) {
+    if( !storageRegistered( storageRecords[r].id ) ) size += storageRecordSize( storageRecords[r].size );
+  }
+  return size;
+}
+
+// Copy record of not registered block from another sector to active one
+bool storageCopyRecord( int sector, StorageRecord* record ) {
+  unsigned short size = record->size;
+  int recordSize = storageRecordSize( size );
+  if( (size > STORAGE_MaxBlockSize) || (storageOffset + recordSize > STORAGE_SectorSize) ) return false;
+  uint32_t address = storageAddress( sector, record->offset );
+
+  StorageRecordHeader header;
+  header.magic = STORAGE_RecordMagic;
+  header.id = record->id;
+  header.reserved = 0;
+  header.size = size;
+  header.crc = storageCRC( (byte*)&header.id, 4, 0xFFFF );
+  if( !storageFlashCRC( address, size, &header.crc ) ) return false;
+
+  storageWriteBegin( storageAddress( storageSector, storageOffset ) );
+  storageWrite( &header, sizeof(header) );
+  byte chunk[16];
+  for( int p = 0; p < size; p += sizeof(chunk) ) {
+    int n = (size - p > (int)sizeof(chunk)) ? sizeof(chunk) : size - p;
+    if( !storageFlashRead( address + p, chunk, n ) ) return false;
+    storageWrite( chunk, n );
+  }
+  if( !storageWriteFlush() ) {
+    storageMustCompact = true;
+    return false;
+  }
+  record->offset = storageOffset + sizeof(header);
+  storageOffset += recordSize;
+  return true;
+}
+
+// Write latest version of all blocks into the next sector of the ring.
+// Previous sector stays active until the new one is complete: on failure or power loss
+// nothing is lost and compaction is repeated
+bool storageCompact() {
+  aePrintln(F("Compacting Storage"));
+  int previous = storageSector;
+  unsigned short previousOffset = storageOffset;
+  int count = storageRecordCount;
+  StorageRecord records[STORAGE_MaxBlocks];
+  memcpy( records, storageRecords, sizeof(records) );
+
+  bool ok = storageFormatSector( (storageSector + 1) % storageSectors );
+  // Blocks registered later (or by previous firmware) are copied from the previous sector
+  for( int r = 0; ok && (previous != storageSector) && (r < count); r++ ) {
+    if( storageRegistered( records[r].id ) ) continue;
+    StorageRecord record = records[r];
+    ok = storageCopyRecord( previous, &record );
+    if( ok ) storageRecords[storageRecordCount++] = record;
+  }
+  for( int i = 0; ok && (i<storageBlockCount); i++) ok = storageAppend( i );
+  ok = ok && storageCloseSector( storageGeneration + 1 );
+
+  if( !ok ) {
+    storageSector = previous;
+    storageOffset = previousOffset;
+    storageRecordCount = count;
+    memcpy( storageRecords, records, sizeof(records) );
+    for( int i = 0; (i<storageBlockCount); i++) storageDirty[i] = true;
+    storageMustCompact = true;
+    return false;
+  }
+  storageMustCompact = false;
+  return true;
+}
+
+// Remember location of the block data in active sector
+void storageRemember( char id, unsigned short offset, unsigned short size ) {
+  int i = 0;
+  while( (i < storageRecordCount) && (storageRecords[i].id != id) ) i++;
+  if( i >= STORAGE_MaxBlocks ) return;
+  if( i == storageRecordCount ) storageRecordCount++;
+  storageRecords[i].id = id;
+  storageRecords[i].offset = offset;
+  storageRecords[i].size = size;
+}
+
+// Import snapshot written by previous EEPROM based firmware, if any
+void storageReadSnapshot() {
+  byte magic[2];
+  if( !storageFlashRead( storageAddress( storageSector, 0 ), magic, 2 ) ) return;
+  if( (magic[0] != 0x41) || (magic[1] != 0x45) ) return;
+  unsigned short p = 2;
+  while( p + sizeof(StorageSnapshotHeader) < STORAGE_SectorSize ) {
+    StorageSnapshotHeader header;
+    if( !storageFlashRead( storageAddress( storageSector, p ), &header, sizeof(header) ) ) return;
+    p += sizeof(StorageSnapshotHeader);
+    if( (header.id == 0) || (p + header.size > STORAGE_SectorSize) ) return;
+    storageRemember( header.id, p, header.size );
+    p += header.size;
+  }
+}
+
+// Count sectors of FS area which end right below EEPROM
+void storageFindSectors() {
+  uintptr_t eeprom = (uintptr_t)&_EEPROM_start;
+  int available = 0;
+  if( ((uintptr_t)&_FS_end == eeprom) && ((uintptr_t)&_FS_start < eeprom) ) {
+    available = (eeprom - (uintptr_t)&_FS_start) / STORAGE_SectorSize;
+  }
+  storageSectors = 1 + ((available < STORAGE_Sectors-1) ? available : STORAGE_Sectors-1);
+  if( storageSectors < STORAGE_Sectors ) aePrintln(F("Storage: no FS space reserved for journal"));
+}
+
+// Find active sector and locate latest valid record of every block
 void storageRead() {
-  
-  EEPROM.get( 0, storageSnapshot);
-  if( (storageSnapshot[0] != 0x41) || (storageSnapshot[1] != 0x45) ) {
-    memset( storageSnapshot, 0, STORAGE_Size );
-    storageSnapshot[0] = 0x41;
-    storageSnapshot[1] = 0x45;
+  storageRecordCount = 0;
+  int active = -1;
+  uint32_t generation = 0;
+  for( int i=0; i<storageSectors; i++ ) {
+    StorageSectorHeader header;
+    if( !storageFlashRead( storageAddress( i, 0 ), &header, sizeof(header) ) ) continue;
+    if( header.magic != STORAGE_SectorMagic ) continue;
+    if( (active < 0) || ((int32_t)(header.generation - generation) > 0) ) {
+      active = i;
+      generation = header.generation;
+    }
+  }
+
+  if( active < 0 ) {
+    // No journal yet
+    storageSector = storageSectors-1;
+    storageGeneration = 0;
+    storageOffset = STORAGE_SectorSize;
+    storageMustCompact = true;
+    storageReadSnapshot();
     changedOn = millis();
+    return;
   }
-    
-  for( int i = 0; (i<storageBlockCount); i++) {
-    void* p = storageSnapshotFind( storageIds[i] );
-    if( p != NULL ) {
-      memcpy( storageBlocks[i], p, storageSizes[i] );
+
+  storageSector = active;
+  storageGeneration = generation;
+  storageOffset = sizeof(StorageSectorHeader);
+  while( storageOffset + sizeof(StorageRecordHeader) <= STORAGE_SectorSize ) {
+    StorageRecordHeader header;
+    uint32_t address = storageAddress( storageSector, storageOffset );
+    if( !storageFlashRead( address, &header, sizeof(header) ) ) break;
+    // Erased flash: end of journal
+    if( header.magic == 0xFFFF ) break;
+    int recordSize = storageRecordSize( header.size );
+    uint16_t crc = storageCRC( (byte*)&header.id, 4, 0xFFFF );
+    if( (header.magic != STORAGE_RecordMagic) || (header.size > STORAGE_MaxBlockSize)
+        || (storageOffset + recordSize > STORAGE_SectorSize)
+        || !storageFlashCRC( address + sizeof(header), header.size, &crc ) ) {
+      // Damaged journal (e.g. power loss while writing): stop here and rewrite it on next save
+      storageMustCompact = true;
+      break;
+    }
+    if( header.crc == crc ) {
+      storageRemember( header.id, storageOffset + sizeof(header), header.size );
     } else {
-      memset( storageBlocks[i], 0, storageSizes[i] );
+      storageMustCompact = true;
     }
+    storageOffset += recordSize;
   }
+  if( storageMustCompact ) changedOn = millis();
 }
 
 // Register new memory block with storage library
 void storageRegisterBlock(char id, void* data, unsigned short size ) {
   storageInit();
-  storageIds[storageBlockCount] = id;
-  storageBlocks[storageBlockCount] = data;
-  storageSizes[storageBlockCount] = size;
-  storageBlockCount++;
-  void* p = storageSnapshotFind(id);
-  
-  if( p != NULL ) {
-    memcpy( data, p, size );
-  } else {
-    changedOn = millis();
-    storageMakeSnapshot();
+  if( storageBlockCount >= STORAGE_MaxBlocks ) return;
+  int i = storageBlockCount++;
+  storageIds[i] = id;
+  storageBlocks[i] = data;
+  storageSizes[i] = size;
+  storageDirty[i] = true;
+
+  for( int r = 0; r < storageRecordCount; r++ ) {
+    if( storageRecords[r].id == id ) {
+      // Block may grow or shrink between firmware versions
+      unsigned short storedSize = storageRecords[r].size;
+      storageFlashRead( storageAddress( storageSector, storageRecords[r].offset ), data, (storedSize < size) ? storedSize : size );
+      storageDirty[i] = (storedSize != size);
+    }
   }
+  if( storageDirty[i] ) changedOn = millis();
+  storageHashes[i] = storageHash( data, size );
 }
 
 void storageSave() {
   storageInit();
   if( isChanged() ) {
     aePrintln(F("Writing Storage"));
-    EEPROM.put( 0, storageSnapshot);
-    EEPROM.commit();
+    bool ok = !storageMustCompact;
+    for( int i = 0; ok && (i<storageBlockCount); i++) {
+      if( storageDirty[i] ) ok = storageAppend( i );
+    }
+    // No room left in active sector
+    if( !ok ) {
+      // Single sector: wait for storageLoop rather than erase blocks not registered yet
+      if( !storageCanCompact() ) return;
+      if( !storageCompact() ) {
+        // Retry later
+        changedOn = millis();
+        return;
+      }
+    }
     changedOn = 0;
   }
 }
 
-// Every minute checks if storage blocks changed.
-// If more then STORAGE_SaveDelay passed since last change then save storage to EMMC
+// Every second checks if storage blocks changed.
+// If more then STORAGE_SaveDelay passed since last change then save storage to flash
 void storageLoop() {
-  static unsigned long checkedOn = 0;
   unsigned long t = millis();
-  if( ((unsigned long)(t - checkedOn)) > ((unsigned long)60000) ) {
-    checkedOn = t;
-    if( isChanged() ) {
-      if( ((unsigned long)(t - changedOn)) > STORAGE_SaveDelay ) {
-        storageSave();
-      }
+  if( isChanged() ) {
+    if( ((unsigned long)(t - changedOn)) > STORAGE_SaveDelay ) {
+      // Blocks not registered by now are not used by this firmware
+      if( !storageCanCompact() ) storageRecordCount = 0;
+      storageSave();
     }
+  } else if( storageCanCompact() && (storageMustCompact || ((storageOffset > STORAGE_CompactThreshold) && (storageJournalSize() < STORAGE_CompactThreshold))) ) {
+    // Prepare room for next saves while there is nothing to write
+    storageCompact();
+  }
+}
+
+// Erase all journal sectors
+void storageErase() {
+  for( int i=0; i<storageSectors; i++ ) {
+    ESP.flashEraseSector( STORAGE_FirstSector + i );
   }
 }
 
@@ -144,17 +516,19 @@ void storageLoop() {
 void storageInit( bool reset ) {
   static bool initialized = false;
   if( !initialized ) {
-    EEPROM.begin( STORAGE_Size );
-    registerLoop(storageLoop);
+    storageFindSectors();
+    scheduleEvery( STORAGE_CheckInterval, storageLoop, "storage" );
   }
 
   if( reset ) {
-    memset( storageSnapshot, 0, sizeof(storageSnapshot) );
-    EEPROM.put( 0, storageSnapshot);
-    EEPROM.commit();
+    storageErase();
+    storageRecordCount = 0;
+    for( int i = 0; (i<storageBlockCount); i++) storageDirty[i] = true;
+    storageOffset = STORAGE_SectorSize;
+    storageMustCompact = true;
     changedOn = 0;
   }
-  
+
   if( !initialized ) {
     initialized = true;
     storageRead();
@@ -168,9 +542,7 @@ void storageInit() {
 void storageReset() {
   aePrintln(F("Clearing Storage"));
   storageInit();
-  memset( storageSnapshot, 0, sizeof(storageSnapshot) );
-  EEPROM.put( 0, storageSnapshot);
-  EEPROM.commit();
+  storageErase();
   delay(1000);
   ESP.restart();
 }
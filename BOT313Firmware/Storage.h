@@ -14,6 +14,9 @@ void storageReset();
 // Register new memory block with storage library
 void storageRegisterBlock( char id, void* data, unsigned short size );
 
+// Mark block as changed without waiting for periodic change detection
+void storageMarkDirty( char id );
+
 // Force storage to save changes immediately (if any)
 void storageSave();
 
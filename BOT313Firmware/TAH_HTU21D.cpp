@@ -1,8 +1,7 @@
 #include <Arduino.h>
-#include <EEPROM.h>
 #include "Config.h"
 #include "Comms.h"
-#include "SparkFunHTU21D.h" // SparkFun HTU21D library: https://github.com/sparkfun/SparkFun_HTU21D_Breakout_Arduino_Library
+#include <Wire.h>
 #include "TAH_HTU21D.h"
 
 static char* TOPIC_TAHValid PROGMEM = "Sensors/TAHValid";
@@ -10,15 +9,68 @@ static char* TOPIC_Temperature PROGMEM = "Sensors/Temperature";
 static char* TOPIC_Humidity PROGMEM = "Sensors/Humidity";
 static char* TOPIC_HeatIndex PROGMEM = "Sensors/HeatIndex";
 static char* TOPIC_AbsHumidity PROGMEM = "Sensors/AbsHumidity";
+static char* TOPIC_TAHErrors PROGMEM = "Sensors/TAHErrors";
 
 #define ValidityTimeout ((unsigned long)(30*1000))
+// Measurement period: starts at TAH_ReadIntervalMin, doubles up to TAH_ReadIntervalMax
+// while filtered readings stay within quarter of publishing deadband or sensor keeps failing
+#define TAH_ReadIntervalMin ((unsigned long)1000)
+#define TAH_ReadIntervalMax ((unsigned long)8000)
 
-//Create an instance of the object
-HTU21D tahSensor;
+// Median filter window (odd, 1 to disable) and weight of new median in moving average (1 to disable)
+#ifndef TAH_MedianSize
+  #define TAH_MedianSize 3
+#endif
+#ifndef TAH_EmaWeight
+  #define TAH_EmaWeight 0.3
+#endif
+// Samples further than this from filtered value are rejected as outliers, unless
+// TAH_MaxRejects of them come in a row: then filter restarts from the new value
+#define TAH_MaxTemperatureStep 3.0
+#define TAH_MaxHumidityStep 10.0
+#define TAH_MaxRejects 3
+// Changes of filtered values to be published
+#ifndef TAH_TemperatureDeadband
+  #define TAH_TemperatureDeadband 0.55
+#endif
+#ifndef TAH_HumidityDeadband
+  #define TAH_HumidityDeadband 1.4
+#endif
 
+// Error counter is published when sensor starts or stops failing and at most this often in between
+#define TAH_ErrorsInterval ((unsigned long)(60*1000))
+
+// HTU21D I2C address and "no hold master" measurement commands
+#define TAH_Address 0x40
+#define TAH_MeasureTemperature 0xF3
+#define TAH_MeasureHumidity 0xF5
+// Max conversion time at 14 bit temperature and 12 bit humidity resolution, ms
+#define TAH_TemperatureTime ((unsigned long)50)
+#define TAH_HumidityTime ((unsigned long)16)
+
+// Median + exponential moving average filter state
+struct TahFilter {
+  float samples[TAH_MedianSize];
+  uint8_t count;
+  uint8_t pos;
+  uint8_t rejects;
+  float value;
+};
+
+TahFilter tahTemperatureFilter;
+TahFilter tahHumidityFilter;
+
+// Filtered readings
 float tahHumidity;
 float tahTemperature;
 unsigned long tahUpdatedOn = 0;
+unsigned long tahInterval = TAH_ReadIntervalMin;
+// Temperature measured in current cycle, committed together with humidity
+float tahNewTemperature;
+// Failed I2C transfers and bad CRC readings
+unsigned long tahErrors = 0;
+// Last measurement cycle failed
+bool tahFailing = false;
 
 bool tahAvailable() {
   return (tahUpdatedOn>0) && (((unsigned long)(millis() - tahUpdatedOn) < ValidityTimeout ));
@@ -27,6 +79,19 @@ bool tahAvailable() {
 //float toFahrenheit(float temp) { return 1.8 * temp + 32.0; };
 //float toCelsius(float temp) { return (temp - 32.0) / 1.8; };
 
+// Saturated water vapour density per 1% RH, g/m3, at 0..50C with TAH_AbsStep step
+#define TAH_AbsStep 2.5
+#define TAH_AbsPoints 21
+static const float tahAbsTable[TAH_AbsPoints] PROGMEM = {
+  0.04815, 0.05710, 0.06747, 0.07946, 0.09328, 0.10913, 0.12729, 0.14802, 0.17161, 0.19840, 0.22872,
+  0.26297, 0.30155, 0.34491, 0.39352, 0.44789, 0.50857, 0.57615, 0.65125, 0.73454, 0.82672
+};
+
+// Values derived from current filtered readings, updated once per sample
+float tahHeatIndexValue;
+float tahAbsHumidityValue;
+
+// NWS heat index regression, powers expanded into products
 float tahHeatIndex() {
   float hi;
   // to farenheit
@@ -34,15 +99,11 @@ float tahHeatIndex() {
   hi = 0.5 * (temperature + 61.0 + ((temperature - 68.0) * 1.2) + (tahHumidity * 0.094));
 
   if (hi > 79) {
-    hi = -42.379 +
-      2.04901523 * temperature +
-      10.14333127 * tahHumidity +
-      -0.22475541 * temperature * tahHumidity +
-      -0.00683783 * pow(temperature, 2) +
-      -0.05481717 * pow(tahHumidity, 2) +
-      0.00122874 * pow(temperature, 2) * tahHumidity +
-      0.00085282 * temperature * pow(tahHumidity, 2) +
-      -0.00000199 * pow(temperature, 2) * pow(tahHumidity, 2);
+    float t = temperature;
+    float h = tahHumidity;
+    hi = -42.379 + 2.04901523 * t + 10.14333127 * h - 0.22475541 * t * h
+      - 0.00683783 * t * t - 0.05481717 * h * h + 0.00122874 * t * t * h
+      + 0.00085282 * t * h * h - 0.00000199 * t * t * h * h;
 
     if ((tahHumidity < 13) && (temperature >= 80.0) && (temperature <= 112.0)) {
       hi -= ((13.0 - tahHumidity) * 0.25) * sqrt((17.0 - abs(temperature - 95.0)) * 0.05882);
@@ -52,8 +113,17 @@ float tahHeatIndex() {
   }
   return (hi - 32.0) / 1.8;
 }
+
+// Magnus formula based absolute humidity, g/m3. Saturated vapour density is linearly
+// interpolated from table (error is within 0.12 g/m3 at 0..50C), extrapolated outside of it
 float tahAbsHumidity(){
-  return 6.112*pow(2.71828,(17.67*tahTemperature)/(tahTemperature+243.5))*tahHumidity*2.1674/(275.15+tahTemperature);
+  float x = tahTemperature / TAH_AbsStep;
+  int i = (int)x;
+  if( i < 0 ) i = 0;
+  if( i > TAH_AbsPoints - 2 ) i = TAH_AbsPoints - 2;
+  float a = pgm_read_float( &tahAbsTable[i] );
+  float b = pgm_read_float( &tahAbsTable[i+1] );
+  return (a + (b - a) * (x - i)) * tahHumidity;
 }
 
 float tahGetTemperature(){
@@ -63,10 +133,10 @@ float tahGetHumidity() {
   return tahHumidity;
 }
 float tahGetHeatIndex() {
-  return tahHeatIndex();
+  return tahHeatIndexValue;
 }
 float tahGetAbsHumidity() {
-  return tahAbsHumidity();
+  return tahAbsHumidityValue;
 }
 
 void tahPublishStatus() {
@@ -77,6 +147,19 @@ void tahPublishStatus() {
   if( valid != _valid ) {
     if( mqttPublish( TOPIC_TAHValid, valid, true ) ) _valid = valid;
   }
+
+  static unsigned long _errors = 0;
+  static bool _failing = false;
+  static unsigned long errorsReported = 0;
+  if( tahErrors == _errors ) {
+    _failing = tahFailing;
+  } else if( (tahFailing != _failing) || ((unsigned long)(millis() - errorsReported) > TAH_ErrorsInterval) ) {
+    if( mqttPublish( TOPIC_TAHErrors, tahErrors, false ) ) {
+      _errors = tahErrors;
+      _failing = tahFailing;
+      errorsReported = millis();
+    }
+  }
   if( valid==0 ) return;
   
   char b[31];
@@ -88,7 +171,7 @@ void tahPublishStatus() {
 
   //aePrintf("t=%f, _t=%f, delta=%f\n", tahTemperature, _temperature, delta );
 
-  if( delta > 0.55 ){
+  if( delta > TAH_TemperatureDeadband ){
     hindex = true;
     dtostrf( ((float)((int)(tahTemperature*2)))/2.0, 0, 1, b );
     if( mqttPublish( TOPIC_Temperature, b, true ) ) _temperature = tahTemperature;
@@ -96,41 +179,140 @@ void tahPublishStatus() {
 
   static float _humidity = -1000;
   delta = tahHumidity - _humidity;  if(delta<0) delta = -delta;
-  if( delta > 1.4 ){
+  if( delta > TAH_HumidityDeadband ){
     hindex = true;
     if( mqttPublish( TOPIC_Humidity, (int)tahHumidity, true ) ) _humidity = tahHumidity;
   }
   
   if( hindex ) {
-    dtostrf( ((float)((int)(tahHeatIndex()*2)))/2.0, 0, 1, b );
+    dtostrf( ((float)((int)(tahHeatIndexValue*2)))/2.0, 0, 1, b );
     mqttPublish( TOPIC_HeatIndex, b, true );
-    dtostrf( ((float)((int)(tahAbsHumidity()*2)))/2.0, 0, 1, b );
+    dtostrf( ((float)((int)(tahAbsHumidityValue*2)))/2.0, 0, 1, b );
     mqttPublish( TOPIC_AbsHumidity, b, true );
   }
 }
 
-void tahLoop() {
-  unsigned long t = millis();
-  static unsigned long checkedOn;
-  
-  if( (unsigned long)(t - checkedOn) > (unsigned long)1000 ) {
-    checkedOn = t;
-    float humidity = tahSensor.readHumidity();
-    float temperature = tahSensor.readTemperature();
+// CRC-8 of HTU21D measurement: polynomial x^8 + x^5 + x^4 + 1, initial value 0
+uint8_t tahCRC8( uint8_t msb, uint8_t lsb ) {
+  uint16_t r = ((uint16_t)msb << 8) | lsb;
+  for( int i=0; i<16; i++ ) {
+    r = (r & 0x8000) ? ((r << 1) ^ 0x3100) : (r << 1);
+  }
+  return r >> 8;
+}
 
-    if( (humidity < 990) && (temperature<990) ) {
-      tahTemperature = temperature;
-      tahHumidity = humidity;
+// Send measurement command. Sensor releases bus and converts in background
+bool tahStart( uint8_t command ) {
+  Wire.beginTransmission( TAH_Address );
+  Wire.write( command );
+  if( Wire.endTransmission() == 0 ) return true;
+  tahErrors++;
+  return false;
+}
 
+// Read measurement result. Returns raw value with status bits cleared or -1 on error
+long tahRead( bool humidity ) {
+  if( Wire.requestFrom( (uint8_t)TAH_Address, (uint8_t)3 ) != 3 ) {
+    while( Wire.available() > 0 ) Wire.read();
+    tahErrors++;
+    return -1;
+  }
+  uint8_t msb = Wire.read();
+  uint8_t lsb = Wire.read();
+  uint8_t crc = Wire.read();
+  // Status bit 1 tells humidity from temperature measurement
+  if( (tahCRC8( msb, lsb ) != crc) || (((lsb & 0x02) != 0) != humidity) ) {
+    tahErrors++;
+    return -1;
+  }
+  return (((uint16_t)msb << 8) | lsb) & 0xFFFC;
+}
+
+// Pass sample through filter. Returns false if sample is rejected as outlier
+bool tahFilter( TahFilter* f, float sample, float maxStep ) {
+  if( f->count > 0 ) {
+    float delta = sample - f->value;  if(delta<0) delta = -delta;
+    if( (delta > maxStep) && (++f->rejects < TAH_MaxRejects) ) return false;
+    // Consistent jump: restart filter from new value
+    if( delta > maxStep ) {
+      f->count = 0;
+      f->pos = 0;
+    }
+  }
+  f->rejects = 0;
+  f->samples[f->pos] = sample;
+  f->pos = (f->pos + 1) % TAH_MedianSize;
+  if( f->count < TAH_MedianSize ) f->count++;
+
+  // Median of collected samples
+  float sorted[TAH_MedianSize];
+  for( int i=0; i<f->count; i++ ) {
+    int j = i;
+    while( (j > 0) && (sorted[j-1] > f->samples[i]) ) { sorted[j] = sorted[j-1]; j--; }
+    sorted[j] = f->samples[i];
+  }
+  float median = sorted[f->count / 2];
+  f->value = (f->count == 1) ? median : f->value + (TAH_EmaWeight) * (median - f->value);
+  return true;
+}
+
+// Schedule next measurement cycle, backing off while sensor fails
+void tahLoop();
+void tahNext( bool failed ) {
+  tahFailing = failed;
+  if( failed && (tahInterval < TAH_ReadIntervalMax) ) tahInterval = min( tahInterval * 2, TAH_ReadIntervalMax );
+  scheduleAt( millis() + tahInterval, tahLoop, "tah" );
+  tahPublishStatus();
+}
+
+void tahCollectHumidity() {
+  long raw = tahRead( true );
+  if( raw >= 0 ) {
+    float temperature = tahTemperature;
+    float humidity = tahHumidity;
+    bool valid = tahFilter( &tahTemperatureFilter, tahNewTemperature, TAH_MaxTemperatureStep );
+    if( tahFilter( &tahHumidityFilter, -6.0 + 125.0 * raw / 65536.0, TAH_MaxHumidityStep ) && valid ) {
+      tahTemperature = tahTemperatureFilter.value;
+      tahHumidity = tahHumidityFilter.value;
+      tahHeatIndexValue = tahHeatIndex();
+      tahAbsHumidityValue = tahAbsHumidity();
       //aePrintf("t=%f, h=%f\n", tahTemperature, tahHumidity );
-      tahUpdatedOn = t;
+      tahUpdatedOn = millis();
+
+      // Sample less often while readings are stable
+      float dt = tahTemperature - temperature;  if(dt<0) dt = -dt;
+      float dh = tahHumidity - humidity;  if(dh<0) dh = -dh;
+      if( (dt > TAH_TemperatureDeadband / 4) || (dh > TAH_HumidityDeadband / 4) ) {
+        tahInterval = TAH_ReadIntervalMin;
+      } else if( tahInterval < TAH_ReadIntervalMax ) {
+        tahInterval = min( tahInterval * 2, TAH_ReadIntervalMax );
+      }
     }
-    tahPublishStatus();
+  }
+  tahNext( raw < 0 );
+}
+
+void tahCollectTemperature() {
+  long raw = tahRead( false );
+  if( (raw >= 0) && tahStart( TAH_MeasureHumidity ) ) {
+    tahNewTemperature = -46.85 + 175.72 * raw / 65536.0;
+    scheduleAt( millis() + TAH_HumidityTime, tahCollectHumidity, "tah" );
+    return;
+  }
+  tahNext( true );
+}
+
+// Start measurement cycle: temperature, then humidity. Results are collected
+// by scheduled tasks once conversion is done, so loop is never blocked on I2C
+void tahLoop() {
+  if( tahStart( TAH_MeasureTemperature ) ) {
+    scheduleAt( millis() + TAH_TemperatureTime, tahCollectTemperature, "tah" );
+  } else {
+    tahNext( true );
   }
 }
 
 
 void tahInit() {
-  tahSensor.begin();
-  registerLoop( tahLoop );
+  scheduleAt( millis(), tahLoop, "tah" );
 }
@@ -0,0 +1,253 @@
+#include <Arduino.h>
+#include "Config.h"
+#include "ThermSimulator.h"
+
+#ifdef THERM_SIMULATOR
+
+// Room temperature change period while heating or cooling down, ms
+#define THERM_SIM_TempStep ((unsigned long)20000)
+// Room temperature without heating, *2
+#define THERM_SIM_Ambient 36
+// UART byte transmission time at 9600 baud, ms
+#define THERM_SIM_ByteTime 1
+
+uint16 thermCRC16( const uint8* data, int len );
+
+// Register image byte offsets, same as in status frame without 3 bytes header
+#define SIM_Locked 0
+#define SIM_Power 1
+#define SIM_RoomTemp 2
+#define SIM_TargetTemp 3
+#define SIM_Mode 4
+#define SIM_Sensor 5
+#define SIM_FloorTempMax 6
+#define SIM_Hysteresis 7
+#define SIM_TargetTempMax 8
+#define SIM_TargetTempMin 9
+#define SIM_AdjTemp 10
+#define SIM_AntiFroze 12
+#define SIM_PowerOnMemory 13
+#define SIM_FloorTemp 15
+#define SIM_Hours 16
+#define SIM_Minutes 17
+#define SIM_Seconds 18
+#define SIM_Weekday 19
+#define SIM_Schedule 20
+#define SIM_ScheduleTemp 36
+
+void ThermSimulator::begin( unsigned long baud ) {
+  static const uint8_t defaults[THERM_SIM_Registers*2] PROGMEM = {
+    0x00, 0x01, 42, 44,   // unlocked, power on, 21.0, 22.0
+    0x00, 0x00, 35, 1,    // manual mode, internal sensor, floor max 35, hysteresis 0.5
+    35, 5, 0x00, 0x00,    // target range 5..35, no adjustment
+    0x00, 0x01, 0x00, 44, // antifroze off, power on memory, floor 22.0
+    12, 0, 0, 1,          // 12:00:00 Monday
+    6, 0, 8, 0, 11, 30, 12, 30, 17, 0, 22, 0, 8, 0, 23, 0,
+    40, 30, 30, 30, 44, 30, 44, 30
+  };
+  memcpy_P( regs, defaults, sizeof(regs) );
+  requestLen = 0;
+  replyCount = 0;
+  lastTick = millis();
+  lastTempStep = lastTick;
+}
+
+// Advance MCU clock and room temperature
+void ThermSimulator::tick() {
+  unsigned long t = millis();
+  while( (unsigned long)(t - lastTick) >= 1000 ) {
+    lastTick += 1000;
+    if( ++regs[SIM_Seconds] < 60 ) continue;
+    regs[SIM_Seconds] = 0;
+    if( ++regs[SIM_Minutes] < 60 ) continue;
+    regs[SIM_Minutes] = 0;
+    if( ++regs[SIM_Hours] < 24 ) continue;
+    regs[SIM_Hours] = 0;
+    regs[SIM_Weekday] = (regs[SIM_Weekday] % 7) + 1;
+  }
+
+  bool power = (regs[SIM_Power] & 1) != 0;
+  uint8_t room = regs[SIM_RoomTemp];
+  uint8_t target = regs[SIM_TargetTemp];
+  bool heating = (regs[SIM_Power] & 0x10) != 0;
+  if( !power || (room >= target + regs[SIM_Hysteresis]) ) {
+    heating = false;
+  } else if( room + regs[SIM_Hysteresis] <= target ) {
+    heating = true;
+  }
+  regs[SIM_Power] = (regs[SIM_Power] & ~0x10) | (heating ? 0x10 : 0);
+
+  if( (unsigned long)(t - lastTempStep) >= THERM_SIM_TempStep ) {
+    lastTempStep = t;
+    if( heating ) {
+      regs[SIM_RoomTemp]++;
+      regs[SIM_FloorTemp]++;
+    } else if( room > THERM_SIM_Ambient ) {
+      regs[SIM_RoomTemp]--;
+      if( regs[SIM_FloorTemp] > THERM_SIM_Ambient ) regs[SIM_FloorTemp]--;
+    }
+  }
+}
+
+int ThermSimulator::available() {
+  tick();
+  int n = 0;
+  unsigned long t = millis();
+  while( (n < replyCount) && ((long)(t - replyDue[(replyHead + n) % THERM_SIM_BufferSize]) >= 0) ) n++;
+  return n;
+}
+
+int ThermSimulator::peek() {
+  return (available() > 0) ? reply[replyHead] : -1;
+}
+
+int ThermSimulator::read() {
+  if( available() <= 0 ) return -1;
+  uint8_t b = reply[replyHead];
+  replyHead = (replyHead + 1) % THERM_SIM_BufferSize;
+  replyCount--;
+  return b;
+}
+
+size_t ThermSimulator::write( uint8_t b ) {
+  return write( &b, 1 );
+}
+
+// Every write from thermTxLoop() is a complete frame
+size_t ThermSimulator::write( const uint8_t* data, size_t size ) {
+  for( size_t i=0; i<size; i++ ) {
+    if( requestLen < THERM_SIM_BufferSize ) request[requestLen++] = data[i];
+  }
+  processRequest();
+  return size;
+}
+
+// Queue reply bytes with line latency, jitter and faults applied
+void ThermSimulator::sendReply( uint8_t* data, int len ) {
+  uint16 crc = thermCRC16( data, len );
+  data[len++] = crc & 0xFF;
+  data[len++] = crc >> 8;
+  if( (THERM_SIM_CorruptRate > 0) && (random(1000) < THERM_SIM_CorruptRate) ) {
+    data[random(len)] ^= (1 << random(8));
+  }
+
+  unsigned long due = millis() + THERM_SIM_Latency;
+  for( int i=0; (i<len) && (replyCount < THERM_SIM_BufferSize); i++ ) {
+    due += THERM_SIM_ByteTime;
+    if( THERM_SIM_Jitter > 0 ) due += random( THERM_SIM_Jitter + 1 );
+    if( (THERM_SIM_DropRate > 0) && (random(1000) < THERM_SIM_DropRate) ) continue;
+    int p = (replyHead + replyCount) % THERM_SIM_BufferSize;
+    reply[p] = data[i];
+    replyDue[p] = due;
+    replyCount++;
+  }
+}
+
+// Single register write (0x06)
+void ThermSimulator::applyWrite( uint16_t reg, uint16_t value ) {
+  if( reg == 0 ) {
+    regs[SIM_Locked] = (value >> 8) & 1;
+    regs[SIM_Power] = (regs[SIM_Power] & ~0x01) | (value & 1);
+  } else if( reg == 1 ) {
+    uint8_t t = value & 0xFF;
+    if( (t >= regs[SIM_TargetTempMin]*2) && (t <= regs[SIM_TargetTempMax]*2) ) {
+      regs[SIM_TargetTemp] = t;
+      // Target set manually while in schedule mode
+      if( regs[SIM_Mode] & 0x01 ) regs[SIM_Power] |= 0x40;
+    }
+  } else if( reg < THERM_SIM_Registers ) {
+    if( reg == 2 ) regs[SIM_Power] &= ~0x40;
+    regs[reg*2] = value >> 8;
+    regs[reg*2+1] = value & 0xFF;
+  }
+}
+
+// Multiple registers write (0x10)
+void ThermSimulator::applyWrite( uint16_t reg, const uint8_t* data, uint8_t count ) {
+  if( (reg == 2) && (count == 5) ) {
+    // Advanced parameters block: loop mode is written as is, not as mode byte
+    regs[SIM_Mode] = ((data[0] & 0x0F) << 4) | (regs[SIM_Mode] & 0x0F);
+    regs[SIM_Sensor] = data[1];
+    regs[SIM_FloorTempMax] = data[2];
+    regs[SIM_Hysteresis] = data[3];
+    regs[SIM_TargetTempMax] = data[4];
+    regs[SIM_TargetTempMin] = data[5];
+    regs[SIM_AdjTemp] = data[6];
+    regs[SIM_AdjTemp+1] = data[7];
+    regs[SIM_AntiFroze] = data[8];
+    regs[SIM_PowerOnMemory] = data[9];
+    return;
+  }
+  // Time (0x0008) and schedule (0x000a) share layout with the status frame
+  for( int i=0; (i < count*2) && (reg*2 + i < (int)sizeof(regs)); i++ ) {
+    regs[reg*2 + i] = data[i];
+  }
+  if( reg <= 8 ) lastTick = millis();
+}
+
+void ThermSimulator::processRequest() {
+  while( requestLen > 0 ) {
+    uint8_t out[THERM_SIM_Registers*2 + 8];
+    int len = 0;
+    int used;
+
+    if( (requestLen >= 2) && (request[0] == 0xa5) && (request[1] == 0xa5) ) {
+      // WiFi indicator command: no reply
+      requestLen = 0;
+      return;
+    }
+    if( request[0] != 0x01 ) {
+      used = 1;
+    } else if( requestLen < 2 ) {
+      return;
+    } else if( (request[1] == 0x03) || (request[1] == 0x06) ) {
+      used = 8;
+    } else if( request[1] == 0x10 ) {
+      if( requestLen < 7 ) return;
+      used = 9 + request[6];
+    } else {
+      used = 1;
+    }
+    if( used > requestLen ) {
+      if( used > THERM_SIM_BufferSize ) requestLen = 0;
+      return;
+    }
+
+    uint16 crc = thermCRC16( request, used - 2 );
+    if( (used > 1) && (request[used-2] == (crc & 0xFF)) && (request[used-1] == (crc >> 8)) ) {
+      uint16_t reg = (request[2] << 8) | request[3];
+      uint16_t value = (request[4] << 8) | request[5];
+      tick();
+      if( request[1] == 0x03 ) {
+        if( reg + value <= THERM_SIM_Registers ) {
+          out[len++] = 0x01;
+          out[len++] = 0x03;
+          out[len++] = value*2;
+          memcpy( &out[len], &regs[reg*2], value*2 );
+          len += value*2;
+        }
+      } else {
+        if( request[1] == 0x06 ) {
+          applyWrite( reg, value );
+        } else {
+          applyWrite( reg, &request[7], value );
+        }
+        // Writes are confirmed by echo of address, register and value/count
+        memcpy( out, request, 6 );
+        len = 6;
+      }
+      if( len == 0 ) {
+        // Illegal data address exception
+        out[len++] = 0x01;
+        out[len++] = request[1] | 0x80;
+        out[len++] = 0x02;
+      }
+      sendReply( out, len );
+    }
+
+    requestLen -= used;
+    memmove( request, request + used, requestLen );
+  }
+}
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef thermsimulator_h
+#define thermsimulator_h
+#include "Config.h"
+
+#ifdef THERM_SIMULATOR
+// Delay before MCU starts replying, ms
+#ifndef THERM_SIM_Latency
+  #define THERM_SIM_Latency 40
+#endif
+// Max random extra delay before every reply byte, ms
+#ifndef THERM_SIM_Jitter
+  #define THERM_SIM_Jitter 0
+#endif
+// Probability of reply byte to be lost, per mille
+#ifndef THERM_SIM_DropRate
+  #define THERM_SIM_DropRate 0
+#endif
+// Probability of reply frame to be corrupted after CRC is calculated, per mille
+#ifndef THERM_SIM_CorruptRate
+  #define THERM_SIM_CorruptRate 0
+#endif
+
+// Size of request and reply buffers
+#define THERM_SIM_BufferSize 128
+// Number of registers returned by status read
+#define THERM_SIM_Registers 22
+
+// BOT-313 MCU model talking Modbus-like protocol over virtual UART.
+// Keeps register image in the layout of status frame, applies register writes
+// to it and slowly moves room temperature towards target while heating
+class ThermSimulator : public Stream {
+  public:
+    void begin( unsigned long baud );
+
+    int available() override;
+    int read() override;
+    int peek() override;
+    void flush() override {};
+    size_t write( uint8_t b ) override;
+    size_t write( const uint8_t* data, size_t size ) override;
+
+  private:
+    uint8_t regs[THERM_SIM_Registers*2];
+
+    uint8_t request[THERM_SIM_BufferSize];
+    int requestLen = 0;
+
+    uint8_t reply[THERM_SIM_BufferSize];
+    unsigned long replyDue[THERM_SIM_BufferSize];
+    uint8_t replyHead = 0;
+    uint8_t replyCount = 0;
+
+    unsigned long lastTick = 0;
+    unsigned long lastTempStep = 0;
+
+    void tick();
+    void processRequest();
+    void applyWrite( uint16_t reg, uint16_t value );
+    void applyWrite( uint16_t reg, const uint8_t* data, uint8_t count );
+    void sendReply( uint8_t* data, int len );
+};
+
+#endif
+#endif
@@ -65,16 +65,127 @@ char* HACTION(int hAction) {
 static char* TOPIC_SetAutoAdjMode PROGMEM = "SetAutoAdjMode";
 #endif
 static char* TOPIC_SetAntiFroze PROGMEM = "SetAntiFroze";
+static char* TOPIC_SetHeaterPower PROGMEM = "SetHeaterPower";
 static char* TOPIC_PowerOnMemory PROGMEM = "PowerOnMemory";
 static char* TOPIC_SetWeekday PROGMEM = "SetWeekday";
 static char* TOPIC_SetTime PROGMEM = "SetTime";
 
 static char* TOPIC_SetSchedule PROGMEM = "SetSchedule";
 static char* TOPIC_SetSchedule2 PROGMEM = "SetSchedule2";
+static char* TOPIC_EnableOTA PROGMEM = "EnableOTA";
+
+static char* TOPIC_State PROGMEM = "State";
+static char* TOPIC_TxQueue PROGMEM = "Stats/TxQueue";
+static char* TOPIC_TxDropped PROGMEM = "Stats/TxDropped";
+static char* TOPIC_Latency PROGMEM = "Stats/Latency";
+static char* TOPIC_Energy PROGMEM = "Energy";
+#ifdef THERM_BENCHMARK
+static char* TOPIC_RunBenchmark PROGMEM = "RunBenchmark";
+static char* TOPIC_Bench PROGMEM = "Stats/Bench";
+#endif
 
 
 
-#define P3(str) ((char*)(((uint)str)+3))
+// Outgoing frames queue size and max frame length (including CRC)
+#define THERM_TxQueueSize 8
+#define THERM_FrameSize 48
+// thermLoop() call period
+#define THERM_LoopInterval ((unsigned long)10)
+// Minimal pause between frames sent to MCU
+#define THERM_TxGap ((unsigned long)300)
+
+// Status poll period: starts at THERM_PollMin and grows up to THERM_PollMax while MCU state does not change
+#define THERM_PollMin ((unsigned long)4000)
+#define THERM_PollMax ((unsigned long)30000)
+// MCU clock is compared to NTP time only this soon after status reply: thermState time is not
+// updated between polls
+#define THERM_TimeCheckAge ((unsigned long)2000)
+// thermState is considered outdated if no status received from MCU for this time
+#define THERM_StatusTimeout ((unsigned long)60000)
+// Status is read this long after the last write command of a batch
+#define THERM_RefreshDelay ((unsigned long)100)
+// Pending writes are sent once no new commands came for THERM_SettleTime,
+// but not later than THERM_SettleMax after the first one
+#define THERM_SettleTime ((unsigned long)300)
+#define THERM_SettleMax ((unsigned long)2000)
+
+// Pending MCU writes, one bit per write frame confirmed on MCU hardware
+#define THERM_WritePower    0x01 // 0x06 to register 0: locked, power
+#define THERM_WriteTarget   0x02 // 0x06 to register 1: target temperature
+#define THERM_WriteMode     0x04 // 0x06 to register 2: mode byte, sensor
+#define THERM_WriteAdvanced 0x08 // 0x10 to registers 2..6: floor max, hysteresis, target range, adjustment, antifroze
+#define THERM_WriteTime     0x10 // 0x10 to registers 8..9: hours, minutes, seconds, weekday
+#define THERM_WriteSchedule 0x20 // 0x10 to registers 0x0a..0x15: both schedules
+
+// Incoming bytes ring buffer size (power of 2) and max frame length accepted
+#define THERM_RxBufferSize 256
+#define THERM_RxFrameSize 128
+// Line silence treated as end of frame: 3.5 characters at 9600 baud
+#define THERM_RxGap ((unsigned long)4)
+
+// MCU address and Modbus function codes
+#define THERM_Address 0x01
+#define THERM_FnReadRegisters 0x03
+#define THERM_FnWriteRegister 0x06
+#define THERM_FnWriteRegisters 0x10
+
+#ifndef THERM_PUBLISH_MODE
+  #define THERM_PUBLISH_MODE 0
+#endif
+// JSON state document buffer size. Longer documents are split into several messages
+#define THERM_JsonSize 256
+// Commands being traced at once and time to wait for MCU confirmation
+#define THERM_TraceSize 4
+#define THERM_TraceTimeout ((unsigned long)60000)
+// Command latency histogram: upper bound of the first bucket in ms, every next one is twice wider
+#define THERM_LatencyBuckets 8
+#define THERM_LatencyBase 250
+
+// Difference between RoomTemp and filtered HTU21D reading which makes AdjTemp to be corrected
+#define THERM_AutoAdjDeadband 0.75
+
+// Iterations of every benchmark case, whole state publishing sends ~30 MQTT messages per iteration
+#define THERM_BenchIterations 200
+#define THERM_BenchPublishIterations 10
+
+// ThermState change flags: set when field changes, cleared when it is published
+#define THERM_Locked            0x00000001
+#define THERM_Power             0x00000002
+#define THERM_Heating           0x00000004
+#define THERM_TargetSetManually 0x00000008
+#define THERM_RoomTemp          0x00000010
+#define THERM_TargetTemp        0x00000020
+#define THERM_TargetTempMax     0x00000040
+#define THERM_TargetTempMin     0x00000080
+#define THERM_FloorTemp         0x00000100
+#define THERM_FloorTempMax      0x00000200
+#define THERM_AutoMode          0x00000400
+#define THERM_LoopMode          0x00000800
+#define THERM_Sensor            0x00001000
+#define THERM_Hysteresis        0x00002000
+#define THERM_AdjTemp           0x00004000
+#define THERM_AntiFroze         0x00008000
+#define THERM_PowerOnMemory     0x00010000
+#define THERM_Time              0x00020000
+#define THERM_Weekday           0x00040000
+#define THERM_Schedule          0x00080000
+#define THERM_Schedule2         0x00100000
+#define THERM_HAMode            0x00200000
+#define THERM_AutoAdjMode       0x00400000
+#define THERM_TxStats           0x00800000
+#define THERM_Latency           0x01000000
+#define THERM_Energy            0x02000000
+#define THERM_HeaterPower       0x04000000
+#define THERM_All               0x07FFFFFF
+// Changes reported by MCU that keep status polling fast. Time and temperatures change on their own
+#define THERM_PollTriggers      (THERM_All & ~(THERM_Time | THERM_Weekday | THERM_RoomTemp | THERM_FloorTemp | THERM_Latency | THERM_TxStats | THERM_Energy))
+
+// Assign thermState field and mark it changed
+#define THERM_SET( field, flag, value ) { if( thermState.field != (value) ) { thermState.field = (value); thermDirty |= (flag); } }
+// Assign thermState field reported by MCU unless command changing it is not confirmed yet
+#define THERM_MCU_SET( field, flag, value ) { if( (held & (flag)) == 0 ) THERM_SET( field, flag, value ); }
+
+#define P3(str) ((str)+3)
 #pragma endregion
 
 #pragma region Types and Vars
@@ -87,20 +198,53 @@ enum ThermWiFiState {
 
 ThermConfig thermConfig;
 
-char thermData[128];
-int thermDataLen = 0;
+// Incoming bytes ring buffer
+uint8 thermRx[THERM_RxBufferSize];
+uint16 thermRxHead = 0;
+uint16 thermRxTail = 0;
+unsigned long thermLastRead = 0;
 // Current thermostat state
 ThermState thermState;
-// Published thermostat state
-ThermState _thermState;
+// THERM_xxx flags of thermState fields changed but not yet published
+uint32 thermDirty = THERM_All;
 unsigned long thermLastStatusRequest = 0;
+unsigned long thermPollInterval = THERM_PollMin;
+// Status read is due after write commands
+bool thermRefreshPending = false;
+unsigned long thermLastWrite = 0;
+// THERM_Writexxx frames due for fields changed by commands
+uint32 thermPendingWrites = 0;
+unsigned long thermFirstCommand = 0;
+unsigned long thermLastCommand = 0;
+// THERM_xxx flags of fields written to MCU but not confirmed by status read yet
+uint32 thermWrittenFlags = 0;
 unsigned long thermLastStatus = 0;
 unsigned long thermLastPublished = 0;
+// JSON state document being built by thermPublish()
+char thermJson[THERM_JsonSize];
+int thermJsonLen = 0;
 unsigned long thermActivityLocked = 0;
-uint16 thermCRC = 0;
 bool thermDisabled = false;
 
-#ifdef USE_SOFT_SERIAL
+// Outgoing frames queue
+struct ThermFrame {
+  uint8 len;
+  bool crc;
+  uint8 data[THERM_FrameSize];
+};
+
+ThermFrame thermTxQueue[THERM_TxQueueSize];
+uint8 thermTxHead = 0;
+uint8 thermTxCount = 0;
+// Queue depth high-water mark
+uint8 thermTxMax = 0;
+unsigned long thermTxDropped = 0;
+unsigned long thermLastSent = 0;
+
+#ifdef THERM_SIMULATOR
+	#include "ThermSimulator.h"
+	ThermSimulator therm;
+#elif defined(USE_SOFT_SERIAL)
 	#include <SoftwareSerial.h>
 	SoftwareSerial therm(THERM_RX, THERM_TX);
 #else
@@ -109,78 +253,175 @@ bool thermDisabled = false;
 #pragma endregion
 
 #pragma region CRC
-void thermCRCStart() {
-  thermCRC = 0xFFFF;
-}
-void thermCRCNext( uint8 nextByte) {
-  char i;
-  thermCRC ^= nextByte;
-  for (i = 0; i < 8; i++) {
-    if( thermCRC & 0x0001 ) {
-      thermCRC = (thermCRC >> 1)  ^ 0xA001;
-    } else {
-      thermCRC >>= 1;
+// CRC-16/Modbus (poly 0xA001 reflected, init 0xFFFF) over len bytes of data
+#ifdef THERM_CRC_BITWISE
+uint16 thermCRC16( const uint8* data, int len ) {
+  uint16 crc = 0xFFFF;
+  for( int i=0; i<len; i++ ) {
+    crc ^= data[i];
+    for( int b=0; b<8; b++ ) {
+      crc = (crc & 0x0001) ? ((crc >> 1) ^ 0xA001) : (crc >> 1);
     }
   }
+  return crc;
+}
+#else
+static const uint16 thermCRCTable[256] PROGMEM = {
+  0x0000, 0xC0C1, 0xC181, 0x0140, 0xC301, 0x03C0, 0x0280, 0xC241,
+  0xC601, 0x06C0, 0x0780, 0xC741, 0x0500, 0xC5C1, 0xC481, 0x0440,
+  0xCC01, 0x0CC0, 0x0D80, 0xCD41, 0x0F00, 0xCFC1, 0xCE81, 0x0E40,
+  0x0A00, 0xCAC1, 0xCB81, 0x0B40, 0xC901, 0x09C0, 0x0880, 0xC841,
+  0xD801, 0x18C0, 0x1980, 0xD941, 0x1B00, 0xDBC1, 0xDA81, 0x1A40,
+  0x1E00, 0xDEC1, 0xDF81, 0x1F40, 0xDD01, 0x1DC0, 0x1C80, 0xDC41,
+  0x1400, 0xD4C1, 0xD581, 0x1540, 0xD701, 0x17C0, 0x1680, 0xD641,
+  0xD201, 0x12C0, 0x1380, 0xD341, 0x1100, 0xD1C1, 0xD081, 0x1040,
+  0xF001, 0x30C0, 0x3180, 0xF141, 0x3300, 0xF3C1, 0xF281, 0x3240,
+  0x3600, 0xF6C1, 0xF781, 0x3740, 0xF501, 0x35C0, 0x3480, 0xF441,
+  0x3C00, 0xFCC1, 0xFD81, 0x3D40, 0xFF01, 0x3FC0, 0x3E80, 0xFE41,
+  0xFA01, 0x3AC0, 0x3B80, 0xFB41, 0x3900, 0xF9C1, 0xF881, 0x3840,
+  0x2800, 0xE8C1, 0xE981, 0x2940, 0xEB01, 0x2BC0, 0x2A80, 0xEA41,
+  0xEE01, 0x2EC0, 0x2F80, 0xEF41, 0x2D00, 0xEDC1, 0xEC81, 0x2C40,
+  0xE401, 0x24C0, 0x2580, 0xE541, 0x2700, 0xE7C1, 0xE681, 0x2640,
+  0x2200, 0xE2C1, 0xE381, 0x2340, 0xE101, 0x21C0, 0x2080, 0xE041,
+  0xA001, 0x60C0, 0x6180, 0xA141, 0x6300, 0xA3C1, 0xA281, 0x6240,
+  0x6600, 0xA6C1, 0xA781, 0x6740, 0xA501, 0x65C0, 0x6480, 0xA441,
+  0x6C00, 0xACC1, 0xAD81, 0x6D40, 0xAF01, 0x6FC0, 0x6E80, 0xAE41,
+  0xAA01, 0x6AC0, 0x6B80, 0xAB41, 0x6900, 0xA9C1, 0xA881, 0x6840,
+  0x7800, 0xB8C1, 0xB981, 0x7940, 0xBB01, 0x7BC0, 0x7A80, 0xBA41,
+  0xBE01, 0x7EC0, 0x7F80, 0xBF41, 0x7D00, 0xBDC1, 0xBC81, 0x7C40,
+  0xB401, 0x74C0, 0x7580, 0xB541, 0x7700, 0xB7C1, 0xB681, 0x7640,
+  0x7200, 0xB2C1, 0xB381, 0x7340, 0xB101, 0x71C0, 0x7080, 0xB041,
+  0x5000, 0x90C1, 0x9181, 0x5140, 0x9301, 0x53C0, 0x5280, 0x9241,
+  0x9601, 0x56C0, 0x5780, 0x9741, 0x5500, 0x95C1, 0x9481, 0x5440,
+  0x9C01, 0x5CC0, 0x5D80, 0x9D41, 0x5F00, 0x9FC1, 0x9E81, 0x5E40,
+  0x5A00, 0x9AC1, 0x9B81, 0x5B40, 0x9901, 0x59C0, 0x5880, 0x9841,
+  0x8801, 0x48C0, 0x4980, 0x8941, 0x4B00, 0x8BC1, 0x8A81, 0x4A40,
+  0x4E00, 0x8EC1, 0x8F81, 0x4F40, 0x8D01, 0x4DC0, 0x4C80, 0x8C41,
+  0x4400, 0x84C1, 0x8581, 0x4540, 0x8701, 0x47C0, 0x4680, 0x8641,
+  0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040
+};
+
+uint16 thermCRC16( const uint8* data, int len ) {
+  uint16 crc = 0xFFFF;
+  for( int i=0; i<len; i++ ) {
+    crc = (crc >> 8) ^ pgm_read_word( &thermCRCTable[(crc ^ data[i]) & 0xFF] );
+  }
+  return crc;
 }
+#endif
 #pragma endregion
 
 #pragma region Message Sending
+// Queue frame to be sent to MCU. Frames are written by thermTxLoop() one by one
+// with at least THERM_TxGap pause between them
+bool thermSendFrame( const uint8* data, int len, bool appendCRC ) {
+  if( (len <= 0) || (len + (appendCRC ? 2 : 0) > THERM_FrameSize) || (thermTxCount >= THERM_TxQueueSize) ) {
+    thermTxDropped++;
+    thermDirty |= THERM_TxStats;
+    aePrintln(F("TX frame dropped"));
+    return false;
+  }
+  ThermFrame* frame = &thermTxQueue[(thermTxHead + thermTxCount) % THERM_TxQueueSize];
+  memcpy( frame->data, data, len );
+  frame->len = len;
+  frame->crc = appendCRC;
+  if( appendCRC ) {
+    uint16 crc = thermCRC16( data, len );
+    frame->data[frame->len++] = crc & 0x00FF;
+    frame->data[frame->len++] = crc >> 8;
+  }
+  thermTxCount++;
+  if( (data[0] == THERM_Address) && ((data[1] == THERM_FnWriteRegister) || (data[1] == THERM_FnWriteRegisters)) ) {
+    thermRefreshPending = true;
+    thermLastWrite = millis();
+    thermPollInterval = THERM_PollMin;
+  }
+  if( thermTxCount > thermTxMax ) {
+    thermTxMax = thermTxCount;
+    thermDirty |= THERM_TxStats;
+  }
+  return true;
+}
+
 void thermSendMessage( const char* data, bool appendCRC) {
+  uint8 frame[THERM_FrameSize];
+  int len = 0;
   char hex[3] = {0,0,0};
   char* p = (char*)data;
-  thermCRCStart();
   while ( *p>'\0' ) {
     hex[0] = *p; p++;
     hex[1] = *p; p++;
     if( *p == ' ') p++;
-    uint8_t d = strtoul( hex, NULL, 16);
-    thermCRCNext(d);
-    therm.write(d);
-  }
-  if( appendCRC ) {
-    therm.write(thermCRC & 0x00FF);
-    therm.write(thermCRC >> 8 );
-  }
-
-#ifdef THERM_DEBUG
-  char s[256];
-  if( appendCRC ) {
-    sprintf(s, "> %s:%02x%02x\n", data, (thermCRC & 0x00FF), (thermCRC >> 8) );
-  } else {
-    sprintf(s, "> %s\n", data );
+    if( len >= (int)sizeof(frame) ) {
+      thermTxDropped++;
+      thermDirty |= THERM_TxStats;
+      aePrintln(F("TX frame is too long"));
+      return;
+    }
+    frame[len++] = strtoul( hex, NULL, 16);
   }
-  mqttPublish("Log",s,false);
-  aePrintf(s);
-#endif
-  delay(300);
+  thermSendFrame( frame, len, appendCRC );
 }
 
 void thermSendMessage( const char* data) {
   thermSendMessage( data, true );
 }
 
-void thermSendAdvancedParams() {
-  char data[64];
-  int16_t a = (int16_t)(thermState.adjTemp*2.0);
-  thermActivityLocked = millis();
-  
-//  sprintf(data, "%d %02x %02x ", (int16_t)(thermState.adjTemp*2.0), (a>>8) & 0xFF, a & 0xFF  );
-//  mqttPublish("Log",data,false);
-  
-  sprintf( data, "0110000200050a %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x",
-    thermState.loopMode,
-    thermState.sensor,
-    (int)thermState.floorTempMax,
-    (int)(thermState.hysteresis*2.0),
-    (int)thermState.targetTempMax,
-    (int)thermState.targetTempMin,
-    (a>>8) & 0xFF, a & 0xFF,
-    thermState.antiFroze ? 1 : 0,
-    thermState.powerOnMemory ? 1 : 0
-  );
-//  mqttPublish("Log",data,false);
-  thermSendMessage(data);
+// Modbus style frame builders. Register values are sent high byte first
+bool thermReadRegisters( uint16 reg, uint16 count ) {
+  uint8 frame[6] = { THERM_Address, THERM_FnReadRegisters, (uint8)(reg >> 8), (uint8)reg, (uint8)(count >> 8), (uint8)count };
+  return thermSendFrame( frame, sizeof(frame), true );
+}
+
+bool thermWriteRegister( uint16 reg, uint16 value ) {
+  uint8 frame[6] = { THERM_Address, THERM_FnWriteRegister, (uint8)(reg >> 8), (uint8)reg, (uint8)(value >> 8), (uint8)value };
+  return thermSendFrame( frame, sizeof(frame), true );
+}
+
+// data: count*2 bytes of register values
+bool thermWriteRegisters( uint16 reg, const uint8* data, uint8 count ) {
+  uint8 frame[THERM_FrameSize];
+  if( 7 + count*2 + 2 > THERM_FrameSize ) return false;
+  frame[0] = THERM_Address;
+  frame[1] = THERM_FnWriteRegisters;
+  frame[2] = reg >> 8;
+  frame[3] = reg;
+  frame[4] = 0;
+  frame[5] = count;
+  frame[6] = count*2;
+  memcpy( &frame[7], data, count*2 );
+  return thermSendFrame( frame, 7 + count*2, true );
+}
+
+uint16 thermModeRegister() {
+  return ((((thermState.loopMode?1:0) << 4) | (thermState.autoMode?1:0)) << 8) | (thermState.sensor & 0xFF);
+}
+
+// Write next queued frame to MCU if inter-frame pause passed
+void thermTxLoop( unsigned long t ) {
+  if( (thermTxCount == 0) || ((unsigned long)(t - thermLastSent) < THERM_TxGap) ) return;
+
+  ThermFrame* frame = &thermTxQueue[thermTxHead];
+  therm.write( frame->data, frame->len );
+  thermLastSent = t;
+
+#ifdef THERM_DEBUG
+  char s[THERM_FrameSize*3+8];
+  char hex[4];
+  strcpy( s, "> ");
+  for(int i=0; i<frame->len; i++ ) {
+    if( frame->crc && (i == frame->len-2) ) strcat(s, ": ");
+    sprintf( hex, "%02x", frame->data[i]);
+    strcat( s, hex);
+  }
+  mqttPublish("Log",s,false);
+  aePrintln(s);
+#endif
+
+  thermTxHead = (thermTxHead + 1) % THERM_TxQueueSize;
+  thermTxCount--;
+  // Status read following the writes is sent: its reply reflects them
+  if( (thermTxCount == 0) && !thermRefreshPending ) thermWrittenFlags = 0;
 }
 
 // 0: off
@@ -188,106 +429,374 @@ void thermSendAdvancedParams() {
 // 2: slow blink
 // 3: on
 void thermSetWiFiSign(ThermWiFiState wifiState ) {
-  char data[64];
   if( wifiState == ThermWiFiState::Off ) {
-    strcpy(data, "a5a55a5a99c1e90300000000");
+    uint8 data[] = { 0xa5, 0xa5, 0x5a, 0x5a, 0x99, 0xc1, 0xe9, 0x03, 0x00, 0x00, 0x00, 0x00 };
+    thermSendFrame( data, sizeof(data), false );
   } else {
 //   0: BlinkFast
 //   1: Blink
 //   2: On
     uint8 mode = (wifiState == ThermWiFiState::BlinkFast) ? 0 : (wifiState == ThermWiFiState::Blink) ? 1 : 2;
-    sprintf( data, "a5a55a5aa1c1ec0304000000 %02x 000000", mode );
+    uint8 data[] = { 0xa5, 0xa5, 0x5a, 0x5a, 0xa1, 0xc1, 0xec, 0x03, 0x04, 0x00, 0x00, 0x00, mode, 0x00, 0x00, 0x00 };
+    thermSendFrame( data, sizeof(data), false );
   }
-  thermSendMessage( data, false);
+}
+
+
+// Advanced parameters block: registers 2..6 with raw loop mode in place of mode byte
+bool thermWriteAdvanced() {
+  int16_t adj = (int16_t)(thermState.adjTemp*2.0);
+  uint8 data[10] = {
+    (uint8)thermState.loopMode, (uint8)thermState.sensor,
+    (uint8)thermState.floorTempMax, (uint8)(thermState.hysteresis*2.0),
+    (uint8)thermState.targetTempMax, (uint8)thermState.targetTempMin,
+    (uint8)(adj >> 8), (uint8)adj,
+    (uint8)(thermState.antiFroze?1:0), (uint8)(thermState.powerOnMemory?1:0)
+  };
+  return thermWriteRegisters( 0x02, data, 5 );
+}
+
+bool thermWriteTime() {
+  uint8 data[4] = { (uint8)thermState.hours, (uint8)thermState.minutes, (uint8)thermState.seconds, (uint8)thermState.weekday };
+  return thermWriteRegisters( 0x08, data, 2 );
+}
+
+// Whole schedule: 8 "hour, minute" registers followed by 4 registers of two temperatures each
+bool thermWriteSchedule() {
+  uint8 data[24];
+  for( int i=0; i<8; i++ ) {
+    ThermScheduleRecord* r = (i < 6) ? &thermState.schedule[i] : &thermState.schedule2[i - 6];
+    data[i*2] = r->h;
+    data[i*2+1] = r->m;
+    data[16+i] = (uint8)(r->t*2);
+  }
+  return thermWriteRegisters( 0x0a, data, 12 );
+}
+
+// thermState fields written by THERM_Writexxx frames
+uint32 thermWriteFlags( uint32 writes ) {
+  uint32 flags = 0;
+  if( writes & THERM_WritePower ) flags |= THERM_Locked | THERM_Power;
+  if( writes & THERM_WriteTarget ) flags |= THERM_TargetTemp;
+  if( writes & THERM_WriteMode ) flags |= THERM_AutoMode | THERM_LoopMode | THERM_Sensor;
+  if( writes & THERM_WriteAdvanced ) flags |= THERM_FloorTempMax | THERM_Hysteresis | THERM_TargetTempMax | THERM_TargetTempMin
+                                              | THERM_AdjTemp | THERM_AntiFroze | THERM_PowerOnMemory;
+  if( writes & THERM_WriteTime ) flags |= THERM_Time | THERM_Weekday;
+  if( writes & THERM_WriteSchedule ) flags |= THERM_Schedule | THERM_Schedule2;
+  return flags;
+}
+
+// Fields status frames should not overwrite: changed by commands not confirmed by MCU yet
+uint32 thermHeldFlags() {
+  return thermWriteFlags( thermPendingWrites ) | thermWrittenFlags;
+}
+
+// Mark frames to be written to MCU from thermState once commands settle.
+// Repeated commands within settle window result in single write of the last value.
+// MQTT handlers lock activity themselves: firmware initiated writes should not
+void thermQueueWrite( uint32 writes ) {
+  unsigned long t = millis();
+  if( thermPendingWrites == 0 ) thermFirstCommand = t;
+  thermPendingWrites |= writes;
+  thermLastCommand = t;
+}
+
+// Send pending frames. Fields are held against MCU status once their frame is queued:
+// dropped frame leaves them to be refreshed from MCU
+void thermFlushWrites() {
+  uint32 writes = thermPendingWrites;
+  uint32 written = 0;
+  thermPendingWrites = 0;
+  if( (writes & THERM_WritePower) && thermWriteRegister( 0x00, ((thermState.locked?1:0) << 8) | (thermState.power?1:0) ) ) {
+    written |= THERM_WritePower;
+  }
+  if( (writes & THERM_WriteTarget) && thermWriteRegister( 0x01, (uint8)(thermState.targetTemp*2) ) ) {
+    written |= THERM_WriteTarget;
+  }
+  // Advanced block carries raw loop mode in register 2, so mode register goes after it
+  if( (writes & THERM_WriteAdvanced) && thermWriteAdvanced() ) {
+    written |= THERM_WriteAdvanced;
+    thermWrittenFlags |= THERM_LoopMode | THERM_Sensor;
+  }
+  if( (writes & THERM_WriteMode) && thermWriteRegister( 0x02, thermModeRegister() ) ) written |= THERM_WriteMode;
+  if( (writes & THERM_WriteTime) && thermWriteTime() ) written |= THERM_WriteTime;
+  if( (writes & THERM_WriteSchedule) && thermWriteSchedule() ) written |= THERM_WriteSchedule;
+  thermWrittenFlags |= thermWriteFlags( written );
 }
 
 #pragma endregion
 
+#pragma region Latency tracing
+// Command waiting for the first status frame reflecting requested value
+struct ThermTrace {
+  uint32 flag;
+  float value;
+  unsigned long started;
+};
+ThermTrace thermTraces[THERM_TraceSize];
+
+struct ThermLatency {
+  unsigned long count;
+  unsigned long timeouts;
+  unsigned long sum;
+  unsigned long max;
+  unsigned long last;
+  unsigned long hist[THERM_LatencyBuckets];
+};
+ThermLatency thermLatency;
+
+float thermScheduleValue( ThermScheduleRecord schedule[], int recordCount ) {
+  float v = 0;
+  for( int i=0; i<recordCount; i++ ) v += ((schedule[i].h * 60 + schedule[i].m) * 64) + (int)(schedule[i].t*2);
+  return v;
+}
+
+// Current value of traced thermState field
+float thermTraceValue( uint32 flag ) {
+  switch( flag ) {
+    case THERM_Locked: return thermState.locked;
+    case THERM_Power: return thermState.power;
+    case THERM_TargetTemp: return thermState.targetTemp;
+    case THERM_FloorTempMax: return thermState.floorTempMax;
+    case THERM_AutoMode: return thermState.autoMode;
+    case THERM_LoopMode: return thermState.loopMode;
+    case THERM_Sensor: return thermState.sensor;
+    case THERM_AdjTemp: return thermState.adjTemp;
+    case THERM_AntiFroze: return thermState.antiFroze;
+    case THERM_Time: return thermState.hours * 60 + thermState.minutes;
+    case THERM_Weekday: return thermState.weekday;
+    case THERM_Schedule: return thermScheduleValue( thermState.schedule, 6 );
+    case THERM_Schedule2: return thermScheduleValue( thermState.schedule2, 2 );
+  }
+  return 0;
+}
+
+// Start tracing command received just now which has set thermState field to requested value
+void thermTrace( uint32 flag ) {
+  int slot = -1;
+  for( int i=0; i<THERM_TraceSize; i++ ) {
+    // Newer command for the same field supersedes previous one
+    if( thermTraces[i].flag == flag ) { slot = i; break; }
+    if( (thermTraces[i].flag == 0) && (slot < 0) ) slot = i;
+  }
+  if( slot < 0 ) return;
+  thermTraces[slot].flag = flag;
+  thermTraces[slot].value = thermTraceValue( flag );
+  thermTraces[slot].started = millis();
+}
+
+void thermTraceRecord( unsigned long latency ) {
+  thermLatency.count++;
+  thermLatency.sum += latency;
+  thermLatency.last = latency;
+  if( latency > thermLatency.max ) thermLatency.max = latency;
+  int b = 0;
+  unsigned long bound = THERM_LatencyBase;
+  while( (b < THERM_LatencyBuckets-1) && (latency >= bound) ) {
+    b++;
+    bound *= 2;
+  }
+  thermLatency.hist[b]++;
+  thermDirty |= THERM_Latency;
+}
+
+// Match pending commands against state just received from MCU. Held fields were not
+// updated from the frame and still keep requested value: their commands are not confirmed yet
+void thermTraceCheck( unsigned long t, uint32 held ) {
+  for( int i=0; i<THERM_TraceSize; i++ ) {
+    if( thermTraces[i].flag == 0 ) continue;
+    if( ((held & thermTraces[i].flag) == 0) && (thermTraceValue( thermTraces[i].flag ) == thermTraces[i].value) ) {
+      thermTraceRecord( t - thermTraces[i].started );
+      thermTraces[i].flag = 0;
+    } else if( (unsigned long)(t - thermTraces[i].started) > THERM_TraceTimeout ) {
+      thermLatency.timeouts++;
+      thermDirty |= THERM_Latency;
+      thermTraces[i].flag = 0;
+    }
+  }
+}
+
+// {"count":N,"timeouts":N,"avg":ms,"max":ms,"last":ms,"hist":[N,...]}
+char* thermPrintLatency( char* s ) {
+  int len = sprintf( s, "{\"count\":%lu,\"timeouts\":%lu,\"avg\":%lu,\"max\":%lu,\"last\":%lu,\"hist\":[",
+    thermLatency.count, thermLatency.timeouts, (thermLatency.count > 0) ? thermLatency.sum / thermLatency.count : 0UL,
+    thermLatency.max, thermLatency.last );
+  for( int i=0; i<THERM_LatencyBuckets; i++ ) {
+    len += sprintf( s + len, (i > 0) ? ",%lu" : "%lu", thermLatency.hist[i] );
+  }
+  strcpy( s + len, "]}" );
+  return s;
+}
+#pragma endregion
+
+#pragma region Energy accounting
+// Heating statistics for accounting period
+struct ThermEnergy {
+  // Time accounted and time heater was on, ms
+  unsigned long time;
+  unsigned long heating;
+  // Heater switch-ons
+  unsigned long cycles;
+  // Temperatures integrated over time, C*s
+  float room;
+  float floor;
+};
+// Current hour and day, last completed hour and day
+ThermEnergy thermHour;
+ThermEnergy thermDay;
+ThermEnergy thermLastHour;
+ThermEnergy thermLastDay;
+bool thermDayCompleted = false;
+// MCU clock hour current periods belong to
+int thermEnergyHour = -1;
+
+// Account time passed since previous status frame with state reported by it
+void thermAccount( unsigned long t ) {
+  unsigned long dt = t - thermLastStatus;
+  // State is unknown if MCU was silent for too long
+  if( (thermLastStatus == 0) || (dt > THERM_StatusTimeout) ) return;
+  ThermEnergy* periods[2] = { &thermHour, &thermDay };
+  for( int i=0; i<2; i++ ) {
+    periods[i]->time += dt;
+    if( thermState.heating ) periods[i]->heating += dt;
+    periods[i]->room += thermState.roomTemp * (dt / 1000.0f);
+    periods[i]->floor += thermState.floorTemp * (dt / 1000.0f);
+  }
+}
+
+// Close accounting periods when MCU clock enters next hour or day.
+// Day rolls over as soon as hours wrap at 00:00, not on weekday change
+void thermAccountPeriods() {
+  if( (thermEnergyHour >= 0) && (thermState.hours != thermEnergyHour) ) {
+    thermLastHour = thermHour;
+    memset( &thermHour, 0, sizeof(thermHour) );
+    thermDayCompleted = (thermState.hours < thermEnergyHour);
+    if( thermDayCompleted ) {
+      thermLastDay = thermDay;
+      memset( &thermDay, 0, sizeof(thermDay) );
+    }
+    thermDirty |= THERM_Energy;
+  }
+  thermEnergyHour = thermState.hours;
+}
+
+// {"on":s,"duty":%,"cycles":N,"room":C,"floor":C[,"kWh":N]}
+char* thermPrintEnergy( char* s, ThermEnergy* e ) {
+  char room[12];
+  char floor[12];
+  float seconds = (e->time > 0) ? e->time / 1000.0f : 1;
+  dtostrf( e->room / seconds, 0, 1, room );
+  dtostrf( e->floor / seconds, 0, 1, floor );
+  int len = sprintf( s, "{\"on\":%lu,\"duty\":%lu,\"cycles\":%lu,\"room\":%s,\"floor\":%s",
+    e->heating / 1000, (e->time >= 1000) ? (e->heating / 10) / (e->time / 1000) : 0UL, e->cycles, room, floor );
+  if( thermConfig.heaterPower > 0 ) {
+    char kwh[12];
+    dtostrf( (e->heating / 3600000.0f) * thermConfig.heaterPower / 1000.0f, 0, 3, kwh );
+    len += sprintf( s + len, ",\"kWh\":%s", kwh );
+  }
+  strcpy( s + len, "}" );
+  return s;
+}
+#pragma endregion
+
 #pragma region ProcessMessage
-bool thermProcessMessage() {
-  if( thermDataLen < 3 ) return false;
+bool thermScheduleEquals( ThermScheduleRecord a[], ThermScheduleRecord b[], int recordCount ) {
+  for( int i=0; i<recordCount; i++ ) {
+    if( (a[i].h != b[i].h) || (a[i].m != b[i].m) || ((int)(a[i].t*2) != (int)(b[i].t*2)) ) return false;
+  }
+  return true;
+}
 
+
+// Process complete frame with valid CRC received from MCU
+bool thermProcessMessage( const uint8* data, int len ) {
   #ifdef THERM_DEBUG
-    char s[255];
+    char s[THERM_RxFrameSize*3+8];
     char hex[4];
     strcpy( s, "< ");
 
-    for(int i=0; i<thermDataLen; i++ ) {
-      sprintf( hex, "%02x ", thermData[i]);
-      if( i == thermDataLen-2 ) strcat(s, ": ");
+    for(int i=0; i<len; i++ ) {
+      sprintf( hex, "%02x ", data[i]);
+      if( i == len-2 ) strcat(s, ": ");
       strcat( s, hex);
     }
 
     aePrintln(s);
     mqttPublish("Log",s,false);
   #endif
-  
 
-  thermCRCStart(); 
-  for(int i=0; i<thermDataLen-2; i++ ) {
-    thermCRCNext( thermData[i] );
-  }
-
-  if( (thermData[thermDataLen-2] != (thermCRC & 0xFF)) && (thermData[thermDataLen-2] != (thermCRC >> 8)) ) {
-    aePrintln("Bad CRC");
-    return false;
-  }
   // Test if it is valid "Status" packet
-  if( (thermDataLen > 22) // have at least 23 bytes
-      && (thermData[0]==0x01) && (thermData[1]==0x03) // signature is for "Status" packet type
-      && (thermData[11]>thermData[12]) // temperature range is valid
-      //&& (thermData[22]>0) && (thermData[22]<8) // Week day is in range
-      //&& (thermData[19]<24) && (thermData[20]<60) // Hours and minutes are in range
+  if( (len > 22) // have at least 23 bytes
+      && (data[0]==0x01) && (data[1]==0x03) // signature is for "Status" packet type
+      && (data[11]>data[12]) // temperature range is valid
+      //&& (data[22]>0) && (data[22]<8) // Week day is in range
+      //&& (data[19]<24) && (data[20]<60) // Hours and minutes are in range
     ) {
       
-    thermLastStatus = millis();
+    unsigned long received = millis();
+    bool heating = thermState.heating;
+    thermAccount( received );
+    thermLastStatus = received;
     thermLastStatusRequest = thermLastStatus;
+    // Collect changes made by this frame separately from ones not yet published
+    uint32 dirty = thermDirty;
+    thermDirty = 0;
+    uint32 held = thermHeldFlags();
 
-    thermState.locked = thermData[3] & 1;
-    thermState.power = thermData[4] & 1;
-    thermState.heating =  (thermData[4] >> 4) & 1;
-    thermState.targetSetManually =  (thermData[4] >> 6) & 1;
+    THERM_MCU_SET( locked, THERM_Locked, (bool)(data[3] & 1) );
+    THERM_MCU_SET( power, THERM_Power, (bool)(data[4] & 1) );
+    THERM_MCU_SET( heating, THERM_Heating, (bool)((data[4] >> 4) & 1) );
+    THERM_MCU_SET( targetSetManually, THERM_TargetSetManually, (bool)((data[4] >> 6) & 1) );
 
-    thermState.roomTemp =  (thermData[5] & 255) / 2.0;
+    THERM_MCU_SET( roomTemp, THERM_RoomTemp, (data[5] & 255) / 2.0f );
 
-    thermState.targetTemp =  (thermData[6] & 255)/2.0;
-    thermState.targetTempMax = thermData[11];
-    thermState.targetTempMin = thermData[12];
+    THERM_MCU_SET( targetTemp, THERM_TargetTemp, (data[6] & 255) / 2.0f );
+    THERM_MCU_SET( targetTempMax, THERM_TargetTempMax, (float)data[11] );
+    THERM_MCU_SET( targetTempMin, THERM_TargetTempMin, (float)data[12] );
 
-    thermState.floorTemp = (thermData[18] & 0xFF)/2.0;
-    thermState.floorTempMax = thermData[9];
+    THERM_MCU_SET( floorTemp, THERM_FloorTemp, (data[18] & 0xFF) / 2.0f );
+    THERM_MCU_SET( floorTempMax, THERM_FloorTempMax, (int)data[9] );
 
-    thermState.autoMode =  thermData[7] & 0x01;
-    thermState.loopMode =  (thermData[7] >> 4) & 0x0F;
-    thermState.sensor = thermData[8];
-    thermState.hysteresis = thermData[10] / 2.0;
+    THERM_MCU_SET( autoMode, THERM_AutoMode, (bool)(data[7] & 0x01) );
+    THERM_MCU_SET( loopMode, THERM_LoopMode, (data[7] >> 4) & 0x0F );
+    THERM_MCU_SET( sensor, THERM_Sensor, (int)data[8] );
+    THERM_MCU_SET( hysteresis, THERM_Hysteresis, data[10] / 2.0f );
     
-    thermState.adjTemp = ((int16_t)((thermData[13] << 8) + thermData[14]))/2.0;
+    THERM_MCU_SET( adjTemp, THERM_AdjTemp, ((int16_t)((data[13] << 8) + data[14])) / 2.0f );
     
-    thermState.antiFroze = (thermData[15] & 1);
-    thermState.powerOnMemory = (thermData[16] & 1);
+    THERM_MCU_SET( antiFroze, THERM_AntiFroze, (bool)(data[15] & 1) );
+    THERM_MCU_SET( powerOnMemory, THERM_PowerOnMemory, (bool)(data[16] & 1) );
 
-    thermState.hours =  thermData[19];
-    thermState.minutes =  thermData[20];
-    thermState.seconds =  thermData[21];
-    thermState.weekday =  thermData[22];
+    THERM_MCU_SET( hours, THERM_Time, (int)data[19] );
+    THERM_MCU_SET( minutes, THERM_Time, (int)data[20] );
+    if( (held & THERM_Time) == 0 ) thermState.seconds = data[21];
+    THERM_MCU_SET( weekday, THERM_Weekday, (int)data[22] );
 
     // If status packet have schedule data
-    if( thermDataLen > 46 ) {
+    if( len > 46 ) {
+      ThermScheduleRecord schedule[6];
+      ThermScheduleRecord schedule2[2];
       for (int i = 0; i < 6; i++) {
-        thermState.schedule[i].h = thermData[2*i + 23];
-        thermState.schedule[i].m = thermData[2*i + 24];
-        thermState.schedule[i].t = (float)(thermData[i + 39]/2.0);
-        //aePrintf("%d: %d %d %f\n", i, thermState.schedule[i].h, thermState.schedule[i].m, thermState.schedule[i].t );
+        schedule[i].h = data[2*i + 23];
+        schedule[i].m = data[2*i + 24];
+        schedule[i].t = (float)(data[i + 39]/2.0);
         if( i<2 ) {
-          thermState.schedule2[i].h = thermData[2*(i+6) + 23];
-          thermState.schedule2[i].m = thermData[2*(i+6) + 24];
-          thermState.schedule2[i].t = (float)   (thermData[ i + 6  + 39]/2.0);
+          schedule2[i].h = data[2*(i+6) + 23];
+          schedule2[i].m = data[2*(i+6) + 24];
+          schedule2[i].t = (float)   (data[ i + 6  + 39]/2.0);
         }
       }
+      if( ((held & THERM_Schedule) == 0) && !thermScheduleEquals( schedule, thermState.schedule, 6 ) ) {
+        memcpy( thermState.schedule, schedule, sizeof(schedule) );
+        thermDirty |= THERM_Schedule;
+      }
+      if( ((held & THERM_Schedule2) == 0) && !thermScheduleEquals( schedule2, thermState.schedule2, 2 ) ) {
+        memcpy( thermState.schedule2, schedule2, sizeof(schedule2) );
+        thermDirty |= THERM_Schedule2;
+      }
     }
 #ifdef USE_HTU21D    
-    if( (thermState.sensor==0) && thermConfig.autoAdjMode ) {
+    if( (thermState.sensor==0) && thermConfig.autoAdjMode && tahAvailable() ) {
       float t = 0;
       if( thermConfig.autoAdjMode==1 ) {
         t = tahGetTemperature();
@@ -296,23 +805,111 @@ bool thermProcessMessage() {
       }
       float delta = thermState.roomTemp-t;
       if( delta <0 ) delta = -delta;
-      if( (t != 0) && (delta>0.75) ) {
+      if( (t != 0) && (delta>THERM_AutoAdjDeadband) ) {
         delta = t - (thermState.roomTemp - thermState.adjTemp);
-        thermState.adjTemp = (float)((int)(delta * 2)) / 2.0;
-        thermSendAdvancedParams();
+        THERM_SET( adjTemp, THERM_AdjTemp, (float)((int)(delta * 2)) / 2.0f );
+        thermQueueWrite( THERM_WriteAdvanced );
       }
     }
 #endif
+    if( !heating && thermState.heating ) {
+      thermHour.cycles++;
+      thermDay.cycles++;
+    }
+    thermAccountPeriods();
+
+    // Poll often while something is going on, back off when idle
+    if( thermDirty & THERM_PollTriggers ) {
+      thermPollInterval = THERM_PollMin;
+    } else if( thermPollInterval < THERM_PollMax ) {
+      thermPollInterval = min( thermPollInterval * 3 / 2, THERM_PollMax );
+    }
+    thermDirty |= dirty;
+    thermTraceCheck( thermLastStatus, held );
     return true;
   }
   return false;
 }
 #pragma endregion
 
+#pragma region Frame receiving
+int thermRxCount() {
+  return (uint16)(thermRxHead - thermRxTail);
+}
+
+uint8 thermRxPeek( int i ) {
+  return thermRx[(thermRxTail + i) & (THERM_RxBufferSize-1)];
+}
+
+void thermRxSkip( int n ) {
+  thermRxTail += n;
+}
+
+// Expected length of the frame at the ring buffer tail.
+// Returns 0 if more bytes are needed to tell and -1 if no frame can start here
+int thermRxFrameLength() {
+  int n = thermRxCount();
+  if( n < 1 ) return 0;
+  if( thermRxPeek(0) != THERM_Address ) return -1;
+  if( n < 2 ) return 0;
+  uint8 fn = thermRxPeek(1);
+  if( fn == THERM_FnReadRegisters ) {
+    // address, function, byte count, data, CRC
+    if( n < 3 ) return 0;
+    int len = 3 + thermRxPeek(2) + 2;
+    return (len <= THERM_RxFrameSize) ? len : -1;
+  }
+  // Write confirmations echo address, register and value/count
+  if( (fn == THERM_FnWriteRegister) || (fn == THERM_FnWriteRegisters) ) return 8;
+  // Exception: address, function | 0x80, error code, CRC
+  if( (fn & 0x80) != 0 ) return 5;
+  return -1;
+}
+
+// Move UART data into ring buffer and extract complete frames from it.
+// Frame end is detected by expected length and by line silence; on bad CRC
+// parser drops one byte and resyncs on the next frame start
+void thermRxLoop( unsigned long t ) {
+  while (therm.available()>0) {
+    if( thermRxCount() >= THERM_RxBufferSize ) thermRxSkip(1);
+    thermRx[thermRxHead & (THERM_RxBufferSize-1)] = therm.read();
+    thermRxHead++;
+    thermLastRead = t;
+  }
+
+  while( thermRxCount() > 0 ) {
+    int len = thermRxFrameLength();
+    if( len < 0 ) {
+      thermRxSkip(1);
+      continue;
+    }
+    if( (len == 0) || (thermRxCount() < len) ) {
+      // Wait for the rest of the frame unless line is silent
+      if( (unsigned long)(t - thermLastRead) <= THERM_RxGap ) return;
+      thermRxSkip(1);
+      continue;
+    }
+
+    uint8 frame[THERM_RxFrameSize];
+    for( int i=0; i<len; i++ ) frame[i] = thermRxPeek(i);
+
+    // CRC is sent low byte first
+    uint16 crc = thermCRC16( frame, len-2 );
+    if( (frame[len-2] != (crc & 0xFF)) || (frame[len-1] != (crc >> 8)) ) {
+      aePrintln("Bad CRC");
+      thermRxSkip(1);
+      continue;
+    }
+    thermRxSkip(len);
+    thermProcessMessage( frame, len );
+  }
+}
+#pragma endregion
+
 #pragma region Schedule helpers
 char* thermPrintSchedule(char* s, ThermScheduleRecord schedule[], int recordCount ) {
   *s=0;
-  char sr[16];
+  char sr[24];
   char sf[8];
   if( (schedule[0].h>23) || (schedule[0].m>30) ) return s;
 
@@ -331,7 +928,6 @@ char* thermPrintSchedule(char* s, ThermScheduleRecord schedule[], int recordCoun
 void thermParseSchedule( char* payload, unsigned int length, ThermScheduleRecord schedule[], int recordCount ) {
   if( (payload==NULL) || (length<10) ) return;
   char s[256];
-  char s2[16];
   ThermScheduleRecord sch[6];
   char* p = s;
   bool changed = false;
@@ -354,277 +950,269 @@ void thermParseSchedule( char* payload, unsigned int length, ThermScheduleRecord
     if( (errno != 0) || (sch[i].t < thermState.targetTempMin) || (sch[i].t > thermState.targetTempMax) ) return;
     while( (*p != 0) && ( (*p<'0') || (*p>'9') ) ) p++;
 
-    if( (sch[i].h != schedule[i].h ) || (sch[i].m != schedule[i].m ) || ( (int)(sch[i].t*2) != (int)(schedule[i].t*2) ) ) changed = true;
+    if( (sch[i].h != schedule[i].h ) || (sch[i].m != schedule[i].m ) || ((int)(sch[i].t*2) != (int)(schedule[i].t*2)) ) changed = true;
   }
   
   if( !changed ) return;
   
   //aePrintln(thermPrintSchedule( s, sch, recordCount ));
   memcpy( schedule, sch, sizeof(ThermScheduleRecord)*recordCount);
-
-  strcpy(s, "0110000a000c18" );
-  for ( int i = 0; i < 6; i++) {
-    sprintf(s2, "%02x%02x ", thermState.schedule[i].h, thermState.schedule[i].m );
-    strcat(s,s2);
-  }
-  for ( int i = 0; i < 2; i++) {
-    sprintf(s2, "%02x%02x ", thermState.schedule2[i].h, thermState.schedule2[i].m );
-    strcat(s,s2);
-  }
-  for ( int i = 0; i < 6; i++) {
-    sprintf(s2, "%02x ", (int)(thermState.schedule[i].t*2) );
-    strcat(s,s2);
-  }
-  for ( int i = 0; i < 2; i++) {
-    sprintf(s2, "%02x ", (int)(thermState.schedule2[i].t*2) );
-    strcat(s,s2);
-  }
-  aePrintln(s);
-  thermSendMessage(s);
+  thermDirty |= (schedule == thermState.schedule) ? THERM_Schedule : THERM_Schedule2;
+  if( schedule == thermState.schedule ) thermTrace( THERM_Schedule );
+  if( schedule == thermState.schedule2 ) thermTrace( THERM_Schedule2 );
+  thermActivityLocked = millis();
+  thermQueueWrite( THERM_WriteSchedule );
 }
+
 #pragma endregion
 
 #pragma region MQTT subscribtion handling
 void thermConnect() {
-  memset( &_thermState, 0xFF, sizeof(_thermState) );
-  mqttSubscribeTopic( TOPIC_SetTargetTemp );
-  mqttSubscribeTopic( TOPIC_SetPower );
-  mqttSubscribeTopic( TOPIC_SetLocked );
-  mqttSubscribeTopic( TOPIC_SetAutoMode );
-  mqttSubscribeTopic( TOPIC_SetLoopMode );
-  mqttSubscribeTopic( TOPIC_SetSchedule );
-  mqttSubscribeTopic( TOPIC_SetSchedule2 );
-  mqttSubscribeTopic( TOPIC_SetTime );
-  mqttSubscribeTopic( TOPIC_SetWeekday );
-  mqttSubscribeTopic( TOPIC_SetSensor );
-  mqttSubscribeTopic( TOPIC_SetAdjTemp );
-  mqttSubscribeTopic( TOPIC_SetAntiFroze );
-  mqttSubscribeTopic( TOPIC_SetFloorTempMax );
-  mqttSubscribeTopic( TOPIC_SetHAMode );
-
-#ifdef USE_HTU21D
-  mqttSubscribeTopic( TOPIC_SetAutoAdjMode );
-#endif
+  thermDirty = THERM_All;
   thermActivityLocked = millis();
 }
 
 void thermSetPower(bool power) {
     thermActivityLocked = millis();
-    thermState.power = power?1:0;
-    char s[31];
-    sprintf(s, "01060000%02x%02x", thermState.locked, thermState.power );
-    thermSendMessage(s);
+    THERM_SET( power, THERM_Power, power );
+    thermTrace( THERM_Power );
+    thermQueueWrite( THERM_WritePower );
 }
 void thermSetAutoMode(bool autoMode) {
     thermActivityLocked = millis();
-    thermState.autoMode = autoMode?1:0;
+    THERM_SET( autoMode, THERM_AutoMode, autoMode );
+    thermTrace( THERM_AutoMode );
+    thermQueueWrite( THERM_WriteMode );
+}
+
+void thermOnSetTargetTemp( byte* payload, unsigned int length ) {
+  if( (payload != NULL) && (length > 0) && (length<31) ) {
     char s[31];
-    sprintf(s, "01060002%02x%02x", (((thermState.loopMode?1:0) << 4) | thermState.autoMode), thermState.sensor );
-    thermSendMessage(s);
-}
-
-bool thermCallback(char* topic, byte* payload, unsigned int length) {
-  char s[64];
-  if( mqttIsTopic( topic, TOPIC_SetTargetTemp ) ) {
-    if( (payload != NULL) && (length > 0) && (length<31) ) {
-      char s[31];
-      memset( s, 0, sizeof(s) );
-      strncpy( s, ((char*)payload), length );
-      errno = 0;
-      float temp = ((int)(strtof(s,NULL) * 2)) / 2.0 ;
-      if ( (errno == 0) && (temp>=thermState.targetTempMin) && (temp<=thermState.targetTempMax) ) {
-        if( temp != thermState.targetTemp ) {
-          thermActivityLocked = millis();
-          sprintf(s, "0106000100%02x", (int)(temp*2) );
-          thermSendMessage( s );
-          thermState.targetTemp = temp;
-        }
+    memset( s, 0, sizeof(s) );
+    strncpy( s, ((char*)payload), length );
+    errno = 0;
+    float temp = ((int)(strtof(s,NULL) * 2)) / 2.0 ;
+    if ( (errno == 0) && (temp>=thermState.targetTempMin) && (temp<=thermState.targetTempMax) ) {
+      if( temp != thermState.targetTemp ) {
+        thermActivityLocked = millis();
+        THERM_SET( targetTemp, THERM_TargetTemp, temp );
+        thermTrace( THERM_TargetTemp );
+        thermQueueWrite( THERM_WriteTarget );
       }
     }
-    return true;
-  } else if( mqttIsTopic( topic, TOPIC_SetAdjTemp ) ) {
-    if( (payload != NULL) && (length > 0) && (length<31) ) {
-      char s[31];
-      memset( s, 0, sizeof(s) );
-      strncpy( s, ((char*)payload), length );
-      errno = 0;
-      float adjTemp = ((int)(strtof(s,NULL) * 2)) / 2.0 ;
-      if ( (errno == 0) && (adjTemp>=-10) && (adjTemp<=10) ) {
-        thermState.adjTemp = adjTemp;
-        thermSendAdvancedParams();
-      }
+  }
+}
+
+void thermOnSetAdjTemp( byte* payload, unsigned int length ) {
+  if( (payload != NULL) && (length > 0) && (length<31) ) {
+    char s[31];
+    memset( s, 0, sizeof(s) );
+    strncpy( s, ((char*)payload), length );
+    errno = 0;
+    float adjTemp = ((int)(strtof(s,NULL) * 2)) / 2.0 ;
+    if ( (errno == 0) && (adjTemp>=-10) && (adjTemp<=10) ) {
+      thermActivityLocked = millis();
+      THERM_SET( adjTemp, THERM_AdjTemp, adjTemp );
+      thermTrace( THERM_AdjTemp );
+      thermQueueWrite( THERM_WriteAdvanced );
     }
-    return true;
-  } else if( mqttIsTopic( topic, TOPIC_SetFloorTempMax ) ) {
-    if( (payload != NULL) && (length > 0) && (length<31) ) {
-      char s[31];
-      memset( s, 0, sizeof(s) );
-      strncpy( s, ((char*)payload), length );
-      errno = 0;
-      int ftMax = (int)strtof(s,NULL);
-      if ( (errno == 0) && (ftMax>=20) && (ftMax<=45) ) {
-        thermState.floorTempMax = ftMax;
-        thermSendAdvancedParams();
-      }
+  }
+}
+
+void thermOnSetFloorTempMax( byte* payload, unsigned int length ) {
+  if( (payload != NULL) && (length > 0) && (length<31) ) {
+    char s[31];
+    memset( s, 0, sizeof(s) );
+    strncpy( s, ((char*)payload), length );
+    errno = 0;
+    int ftMax = (int)strtof(s,NULL);
+    if ( (errno == 0) && (ftMax>=20) && (ftMax<=45) ) {
+      thermActivityLocked = millis();
+      THERM_SET( floorTempMax, THERM_FloorTempMax, ftMax );
+      thermTrace( THERM_FloorTempMax );
+      thermQueueWrite( THERM_WriteAdvanced );
     }
-    return true;
-  } else if( mqttIsTopic( topic, TOPIC_SetAntiFroze ) ) {
-    if( (payload != NULL) && (length==1) ) {
-      uint8 v = ( (char)*payload == '1' ) ? 1 : ( (char)*payload == '0' ) ? 0 : 99;
-      if( (v<99) && (thermState.antiFroze != (bool)(v&1)) ){
-        thermState.antiFroze = (bool)(v&1);
-        thermSendAdvancedParams();
-      }
+  }
+}
+
+void thermOnSetAntiFroze( byte* payload, unsigned int length ) {
+  if( (payload != NULL) && (length==1) ) {
+    uint8 v = ( (char)*payload == '1' ) ? 1 : ( (char)*payload == '0' ) ? 0 : 99;
+    if( (v<99) && (thermState.antiFroze != (bool)(v&1)) ){
+      thermActivityLocked = millis();
+      THERM_SET( antiFroze, THERM_AntiFroze, (bool)(v&1) );
+      thermTrace( THERM_AntiFroze );
+      thermQueueWrite( THERM_WriteAdvanced );
     }
-    return true;
-  } else if( mqttIsTopic( topic, TOPIC_SetPower ) ) {
-    if( (payload != NULL) && (length==1) ) {
-      char v = ( (char)*payload =='1' ) ? 1 : ( (char)*payload == '0' ) ? 0 : 99;
-      if( (v<99) && (thermState.power != v) ) {
-        thermSetPower( (bool)v );
-      }
+  }
+}
+
+void thermOnSetPower( byte* payload, unsigned int length ) {
+  if( (payload != NULL) && (length==1) ) {
+    char v = ( (char)*payload =='1' ) ? 1 : ( (char)*payload == '0' ) ? 0 : 99;
+    if( (v<99) && (thermState.power != v) ) {
+      thermSetPower( (bool)v );
     }
-    return true;
-  } else if( mqttIsTopic( topic, TOPIC_SetLocked ) ) {
-    if( (payload != NULL) && (length==1) ) {
-      char v = ( (char)*payload =='1' ) ? 1 : ( (char)*payload == '0' ) ? 0 : 99;
-      if( (v<99) && (thermState.locked != (bool)v) ) {
-        thermActivityLocked = millis();
-        thermState.locked = (bool)v;
-        char s[31];
-        sprintf(s, "01060000%02x%02x", v, thermState.power?1:0 );
-        thermSendMessage( s );
-      }
+  }
+}
+
+void thermOnSetLocked( byte* payload, unsigned int length ) {
+  if( (payload != NULL) && (length==1) ) {
+    char v = ( (char)*payload =='1' ) ? 1 : ( (char)*payload == '0' ) ? 0 : 99;
+    if( (v<99) && (thermState.locked != (bool)v) ) {
+      thermActivityLocked = millis();
+      THERM_SET( locked, THERM_Locked, (bool)v );
+      thermTrace( THERM_Locked );
+      thermQueueWrite( THERM_WritePower );
     }
-    return true;
-  } else if( mqttIsTopic( topic, TOPIC_SetAutoMode ) ) {
-    if( (payload != NULL) && (length==1) ) {
-      uint8 v = ( (char)*payload == '1' ) ? 1 : ( (char)*payload == '0' ) ? 0 : 99;
-      if( (v<99) && (thermState.autoMode != (bool)(v&1)) ){
-          thermSetAutoMode((bool)(v & 1));
-      }
+  }
+}
+
+void thermOnSetAutoMode( byte* payload, unsigned int length ) {
+  if( (payload != NULL) && (length==1) ) {
+    uint8 v = ( (char)*payload == '1' ) ? 1 : ( (char)*payload == '0' ) ? 0 : 99;
+    if( (v<99) && (thermState.autoMode != (bool)(v&1)) ){
+        thermSetAutoMode((bool)(v & 1));
     }
-    return true;
-  } else if( mqttIsTopic( topic, TOPIC_SetSensor ) ) {
-    if( (payload != NULL) && (length>0) && (length<31) ) {
-      char s[31];
-      memset( s, 0, sizeof(s) );
-      strncpy( s, ((char*)payload), length );
-      errno = 0;
-      uint8 v = (uint8)atoi(s);
-      if ( (errno == 0) && (v>=0) && (v<=0x0F) && (thermState.sensor != (v&0x0F)) ) {
-        thermActivityLocked = millis();
-        thermState.sensor = (v&0x0F);
-        char s[31];
-        sprintf(s, "01060002%02x%02x", (((thermState.loopMode?1:0) << 4) | (thermState.autoMode?1:0)), thermState.sensor );
-        thermSendMessage( s );
-      }
+  }
+}
+
+void thermOnSetSensor( byte* payload, unsigned int length ) {
+  if( (payload != NULL) && (length>0) && (length<31) ) {
+    char s[31];
+    memset( s, 0, sizeof(s) );
+    strncpy( s, ((char*)payload), length );
+    errno = 0;
+    uint8 v = (uint8)atoi(s);
+    if ( (errno == 0) && (v<=0x0F) && (thermState.sensor != (v&0x0F)) ) {
+      thermActivityLocked = millis();
+      THERM_SET( sensor, THERM_Sensor, (v&0x0F) );
+      thermTrace( THERM_Sensor );
+      thermQueueWrite( THERM_WriteMode );
     }
-    return true;
-  } else if( mqttIsTopic( topic, TOPIC_SetLoopMode ) ) {
-    if( (payload != NULL) && (length>0) && (length<31) ) {
-      char s[31];
-      memset( s, 0, sizeof(s) );
-      strncpy( s, ((char*)payload), length );
-      errno = 0;
-      uint8 v = (uint8)atoi(s);
-      if ( (errno == 0) && (v>=0) && (v<=0x0F) && (thermState.loopMode != (v&0x0F)) ) {
+  }
+}
+
+void thermOnSetLoopMode( byte* payload, unsigned int length ) {
+  if( (payload != NULL) && (length>0) && (length<31) ) {
+    char s[31];
+    memset( s, 0, sizeof(s) );
+    strncpy( s, ((char*)payload), length );
+    errno = 0;
+    uint8 v = (uint8)atoi(s);
+    if ( (errno == 0) && (v<=0x0F) && (thermState.loopMode != (v&0x0F)) ) {
+      thermActivityLocked = millis();
+      THERM_SET( loopMode, THERM_LoopMode, (v&0x0F) );
+      thermTrace( THERM_LoopMode );
+      thermQueueWrite( THERM_WriteMode );
+    }
+  }
+}
+
+void thermOnSetSchedule( byte* payload, unsigned int length ) {
+  if( (payload != NULL) && (length>10) && (length<255) ) {
+    thermParseSchedule( (char*)payload, length, thermState.schedule, 6 );
+  }
+}
+
+void thermOnSetSchedule2( byte* payload, unsigned int length ) {
+  if( (payload != NULL) && (length>10) && (length<255) ) {
+    thermParseSchedule( (char*)payload, length, thermState.schedule2, 2 );
+  }
+}
+
+void thermOnSetWeekday( byte* payload, unsigned int length ) {
+  if( (payload != NULL) && (length>0) ) {
+    if ( (length==1) && (*payload >='1') && (*payload <='7') ) {
+      int v = (*payload)-'0';
+      if( thermState.weekday != v ) {
         thermActivityLocked = millis();
-        thermState.loopMode = (v&0x0F);
-        char s[31];
-        sprintf(s, "01060002%02x%02x", (((thermState.loopMode?1:0) << 4) | (thermState.autoMode?1:0)), thermState.sensor );
-        thermSendMessage( s );
+        THERM_SET( weekday, THERM_Weekday, v );
+        thermTrace( THERM_Weekday );
+        thermQueueWrite( THERM_WriteTime );
       }
     }
-    return true;
-  } else if( mqttIsTopic( topic, TOPIC_SetSchedule ) ) {
-    if( (payload != NULL) && (length>10) && (length<255) ) {
-      thermParseSchedule( (char*)payload, length, thermState.schedule, 6 );
-    }
-    return true;
-  } else if( mqttIsTopic( topic, TOPIC_SetSchedule2 ) ) {
-    if( (payload != NULL) && (length>10) && (length<255) ) {
-      thermParseSchedule( (char*)payload, length, thermState.schedule2, 2 );
-    }
-    return true;
-  } else if( mqttIsTopic( topic, TOPIC_SetWeekday ) ) {
-    if( (payload != NULL) && (length>0) ) {
-      if ( (length==1) && (*payload >='1') && (*payload <='7') ) {
-        int v = (*payload)-'0';
-        if( thermState.weekday != v ) {
-          thermActivityLocked = millis();
-          thermState.weekday = v;
-          char s[31];
-          //0x01,0x10,0x00,0x08,0x00,0x02,0x04,$hour,$minute,$second,$day));
-          sprintf(s, "01100008000204%02x%02x%02x%02x", thermState.hours, thermState.minutes, thermState.seconds, thermState.weekday );
-          thermSendMessage( s );
-        }
+  }
+}
+
+void thermOnSetTime( byte* payload, unsigned int length ) {
+  if( (payload != NULL) && (length>0) && (length<=5) ) {
+    char s[8];
+    memset(s, 0, sizeof(s));
+    memcpy(s, payload, length);
+    char* p = s;
+    errno = 0;
+    int h = (int8)strtol( p, &p, 10 );
+    if( (errno == 0) && ( *p != 0 ) && (h>=0) && (h<=23) ) {
+      while( (*p != 0) && ( (*p<'0') || (*p>'9') ) ) p++;
+      int m = (int8)strtol( p, NULL, 10 );
+      if( (errno == 0) && (m>=0) && (m<=59) && ((thermState.hours != h) || (thermState.minutes != m)) ) {
+        while( (*p != 0) && ( (*p<'0') || (*p>'9') ) ) p++;
+        thermState.seconds = (int8)strtol( p, NULL, 10 );
+        if( (errno != 0) || (thermState.seconds<0) || (thermState.seconds>59) ) thermState.seconds = 0;
+
+        thermActivityLocked = millis();
+        THERM_SET( hours, THERM_Time, h );
+        THERM_SET( minutes, THERM_Time, m );
+        thermState.seconds = 0;
+        thermTrace( THERM_Time );
+        thermQueueWrite( THERM_WriteTime );
       }
     }
-    return true;
-  } else if( mqttIsTopic( topic, TOPIC_SetTime ) ) {
-    if( (payload != NULL) && (length>0) && (length<=5) ) {
-      char s[8];
-      memset(s, 0, sizeof(s));
-      memcpy(s, payload, length);
-      char* p = s;
-      errno = 0;
-      int h = (int8)strtol( p, &p, 10 );
-      if( (errno == 0) && ( *p != 0 ) && (h>=0) && (h<=23) ) {
-        while( (*p != 0) && ( (*p<'0') || (*p>'9') ) ) p++;
-        int m = (int8)strtol( p, NULL, 10 );
-        if( (errno == 0) && (m>=0) && (m<=59) && ((thermState.hours != h) || (thermState.minutes != m)) ) {
-          while( (*p != 0) && ( (*p<'0') || (*p>'9') ) ) p++;
-          thermState.seconds = (int8)strtol( p, NULL, 10 );
-          if( (errno != 0) || (thermState.seconds<0) || (thermState.seconds>59) ) thermState.seconds = 0;
+  }
+}
 
-          thermActivityLocked = millis();
-          thermState.hours = h;
-          thermState.minutes = m;
-          thermState.seconds = 0;
-          char s[31];
-          sprintf(s, "01100008000204%02x%02x%02x%02x", thermState.hours, thermState.minutes, thermState.seconds, thermState.weekday );
-          thermSendMessage( s );
+void thermOnSetHAMode( byte* payload, unsigned int length ) {
+    if ((payload != NULL) && (length > 0) && (length <= 15)) {
+        char s[16];
+        memset(s, 0, sizeof(s));
+        memcpy(s, payload, length);
+        if ( strcmp(s, HAMODE(0) ) == 0 ) { // Off
+            thermSetPower( false );
+            thermSetAutoMode(false);
+        } else if (strcmp(s, HAMODE(1)) == 0) { // Heat
+            thermSetPower(true);
+            thermSetAutoMode(false);
+        } else if (strcmp(s, HAMODE(2)) == 0) { // Auto
+            thermSetPower(true);
+            thermSetAutoMode(true);
         }
-      }
     }
-    return true;
-  } else if (mqttIsTopic(topic, TOPIC_SetHAMode)) {
-      if ((payload != NULL) && (length > 0) && (length <= 15)) {
-          char s[16];
-          memset(s, 0, sizeof(s));
-          memcpy(s, payload, length);
-          if ( strcmp(s, HAMODE(0) ) == 0 ) { // Off
-              thermSetPower( false );
-              thermSetAutoMode(false);
-          } else if (strcmp(s, HAMODE(1)) == 0) { // Heat
-              thermSetPower(true);
-              thermSetAutoMode(false);
-          } else if (strcmp(s, HAMODE(2)) == 0) { // Auto
-              thermSetPower(true);
-              thermSetAutoMode(true);
-          }
-      }
-      return true;
+}
+
 #ifdef USE_HTU21D
-  } else if( mqttIsTopic( topic, TOPIC_SetAutoAdjMode ) ) {
-    if( (payload != NULL) && (length==1) && (thermState.sensor == 0) ) {
-      int m = ( (char)(*payload) - '1' + 1 );
-      if ( (errno == 0) && (m>=0) && (m<=2) ) {
-        thermActivityLocked = millis();
-        thermConfig.autoAdjMode = m;
-        storageSave();
-      }
+void thermOnSetAutoAdjMode( byte* payload, unsigned int length ) {
+  if( (payload != NULL) && (length==1) && (thermState.sensor == 0) ) {
+    int m = ( (char)(*payload) - '1' + 1 );
+    if ( (errno == 0) && (m>=0) && (m<=2) ) {
+      thermActivityLocked = millis();
+      thermConfig.autoAdjMode = m;
+      thermDirty |= THERM_AutoAdjMode;
+      storageSave();
     }
-    return true;
-#endif    
-  } else if( mqttIsTopic( topic, "EnableOTA" ) ) {
-    thermSetWiFiSign( ThermWiFiState::BlinkFast );
-    thermDisabled = true;
-    commsEnableOTA();
-    return true;
   }
-  return false;
+}
+#endif
+
+void thermOnSetHeaterPower( byte* payload, unsigned int length ) {
+  if( (payload != NULL) && (length>0) && (length<31) ) {
+    char s[31];
+    memset( s, 0, sizeof(s) );
+    strncpy( s, ((char*)payload), length );
+    errno = 0;
+    int v = atoi(s);
+    if ( (errno == 0) && (v>=0) && (v<=10000) && (thermConfig.heaterPower != v) ) {
+      thermConfig.heaterPower = v;
+      thermDirty |= THERM_HeaterPower;
+      storageSave();
+    }
+  }
+}
+
+// OTA itself is enabled by Comms handler of the same topic
+void thermOnEnableOTA( byte* payload, unsigned int length ) {
+  thermSetWiFiSign( ThermWiFiState::BlinkFast );
+  thermDisabled = true;
 }
 #pragma endregion
 
@@ -635,154 +1223,340 @@ void thermTriggerActivity() {
   }
 }
 
-void thermPublish( char* topic, float value, float* _value, bool retained, bool activity ) {
-  if( (value != *_value ) ) {
-    char s[8];
-    dtostrf( value, 4,1, s );
-    char* p = s;
-    while( *p==' ') p++;
-    if( mqttPublish( topic, p, retained) ) {
-      *_value = value;
-      thermLastPublished = millis();
-      if( activity ) thermTriggerActivity();
-    }
-  }
+// Publish accumulated JSON state document (if any)
+bool thermJsonFlush() {
+  if( thermJsonLen == 0 ) return true;
+  strcpy( thermJson + thermJsonLen, "}" );
+  thermJsonLen = 0;
+  if( mqttPublish( TOPIC_State, thermJson, false ) ) return true;
+  // Changes were lost: force full state republish
+  thermDirty = THERM_All;
+  return false;
 }
-void thermPublish( char* topic, bool value, bool* _value, bool retained, bool activity ) {
-  if( ((int)value != (int)(*_value) ) && mqttPublish( topic, value?1:0, retained) ) {
-    *_value = value;
-    thermLastPublished = millis();
-    if( activity ) thermTriggerActivity();
+
+// Append "topic":value pair to JSON state document, publish it first if there is no room left
+bool thermJsonAdd( char* topic, char* value, bool quoted ) {
+  if( !mqttConnected() ) return false;
+  int len = strlen(topic) + strlen(value) + 8;
+  if( thermJsonLen + len >= THERM_JsonSize ) {
+    if( !thermJsonFlush() ) return false;
   }
+  thermJsonLen += sprintf( thermJson + thermJsonLen, quoted ? "%c\"%s\":\"%s\"" : "%c\"%s\":%s", 
+    (thermJsonLen == 0) ? '{' : ',', topic, value );
+  return true;
 }
 
-void thermPublish( char* topic, int value, int* _value, bool retained, bool activity ) {
-  if( (value != (*_value) ) && mqttPublish( topic, value, retained) ) {
-    *_value = value;
+// Publish single state value according to THERM_PUBLISH_MODE
+bool thermPublishValue( char* topic, char* value, bool quoted, bool retained ) {
+#if THERM_PUBLISH_MODE != 1
+  if( !mqttPublish( topic, value, retained ) ) return false;
+#endif
+#if THERM_PUBLISH_MODE != 0
+  if( !thermJsonAdd( topic, value, quoted ) ) return false;
+#endif
+  return true;
+}
+
+// Publish value if its change flag is set and clear the flag on success
+void thermPublish( char* topic, char* value, bool quoted, uint32 flag, bool retained, bool activity ) {
+  if( thermPublishValue( topic, value, quoted, retained) ) {
+    thermDirty &= ~flag;
     thermLastPublished = millis();
     if( activity ) thermTriggerActivity();
   }
 }
+void thermPublish( char* topic, float value, uint32 flag, bool retained, bool activity ) {
+  if( (thermDirty & flag) == 0 ) return;
+  char s[8];
+  dtostrf( value, 4,1, s );
+  char* p = s;
+  while( *p==' ') p++;
+  thermPublish( topic, p, false, flag, retained, activity );
+}
+void thermPublish( char* topic, bool value, uint32 flag, bool retained, bool activity ) {
+  if( (thermDirty & flag) == 0 ) return;
+  thermPublish( topic, (char*)(value ? "1" : "0"), false, flag, retained, activity );
+}
+void thermPublish( char* topic, int value, uint32 flag, bool retained, bool activity ) {
+  if( (thermDirty & flag) == 0 ) return;
+  char s[16];
+  sprintf( s, "%d", value );
+  thermPublish( topic, s, false, flag, retained, activity );
+}
 
 void thermPublish() {
+    // Nothing changed since last publishing
+    if( thermDirty == 0 ) return;
     unsigned long t = millis();
     // To avoid MQTT spam
     if( (thermLastStatus == 0) || (unsigned long)(t - thermLastPublished) < (unsigned long)500 ) return;
-    char s[128];
-    char s1[128];
-    thermPublish( P3(TOPIC_SetLocked), thermState.locked, &_thermState.locked, true, true );
-    thermPublish( P3(TOPIC_SetPower), thermState.power, &_thermState.power, true, true );
-    thermPublish( TOPIC_Heating, thermState.heating, &_thermState.heating, true, false );
-    thermPublish( TOPIC_TargetSetManually, thermState.targetSetManually, &_thermState.targetSetManually, true, false );
-    thermPublish( TOPIC_RoomTemp, thermState.roomTemp, &_thermState.roomTemp, true, false );
-    thermPublish( P3(TOPIC_SetTargetTemp), thermState.targetTemp, &_thermState.targetTemp, true, true );
-    thermPublish( TOPIC_TargetTempMax, thermState.targetTempMax, &_thermState.targetTempMax, true, false );
-    thermPublish( TOPIC_TargetTempMin, thermState.targetTempMin, &_thermState.targetTempMin, true, false );
-    thermPublish( TOPIC_FloorTemp, thermState.floorTemp, &_thermState.floorTemp, true, false );
-    thermPublish( P3(TOPIC_SetFloorTempMax), thermState.floorTempMax, &_thermState.floorTempMax, true, false );
-    thermPublish( P3(TOPIC_SetAutoMode), thermState.autoMode, &_thermState.autoMode, true, true );
-    thermPublish( P3(TOPIC_SetLoopMode), thermState.loopMode, &_thermState.loopMode, true, false );
-    thermPublish( P3(TOPIC_SetSensor), thermState.sensor, &_thermState.sensor, true, false );
-    thermPublish( TOPIC_Hysteresis, thermState.hysteresis, &_thermState.hysteresis, true, false );
-    thermPublish( P3(TOPIC_SetAdjTemp), thermState.adjTemp, &_thermState.adjTemp, true, false );
-
-    thermPublish( P3(TOPIC_SetAntiFroze), thermState.antiFroze, &_thermState.antiFroze, true, false );
-    thermPublish( TOPIC_PowerOnMemory, thermState.powerOnMemory, &_thermState.powerOnMemory, true, false );
-    thermPublish( P3(TOPIC_SetWeekday), thermState.weekday, &_thermState.weekday, true, false );
-    if( (thermState.hours != _thermState.hours) || (thermState.minutes != _thermState.minutes) ) {
+    char s[200];
+    // Home Assistant mode and action depend on power, auto mode and heating
+    if( thermDirty & (THERM_Power | THERM_AutoMode | THERM_Heating) ) thermDirty |= THERM_HAMode;
+
+    thermPublish( P3(TOPIC_SetLocked), thermState.locked, THERM_Locked, true, true );
+    thermPublish( P3(TOPIC_SetPower), thermState.power, THERM_Power, true, true );
+    thermPublish( TOPIC_Heating, thermState.heating, THERM_Heating, true, false );
+    thermPublish( TOPIC_TargetSetManually, thermState.targetSetManually, THERM_TargetSetManually, true, false );
+    thermPublish( TOPIC_RoomTemp, thermState.roomTemp, THERM_RoomTemp, true, false );
+    thermPublish( P3(TOPIC_SetTargetTemp), thermState.targetTemp, THERM_TargetTemp, true, true );
+    thermPublish( TOPIC_TargetTempMax, thermState.targetTempMax, THERM_TargetTempMax, true, false );
+    thermPublish( TOPIC_TargetTempMin, thermState.targetTempMin, THERM_TargetTempMin, true, false );
+    thermPublish( TOPIC_FloorTemp, thermState.floorTemp, THERM_FloorTemp, true, false );
+    thermPublish( P3(TOPIC_SetFloorTempMax), thermState.floorTempMax, THERM_FloorTempMax, true, false );
+    thermPublish( P3(TOPIC_SetAutoMode), thermState.autoMode, THERM_AutoMode, true, true );
+    thermPublish( P3(TOPIC_SetLoopMode), thermState.loopMode, THERM_LoopMode, true, false );
+    thermPublish( P3(TOPIC_SetSensor), thermState.sensor, THERM_Sensor, true, false );
+    thermPublish( TOPIC_Hysteresis, thermState.hysteresis, THERM_Hysteresis, true, false );
+    thermPublish( P3(TOPIC_SetAdjTemp), thermState.adjTemp, THERM_AdjTemp, true, false );
+
+    thermPublish( P3(TOPIC_SetAntiFroze), thermState.antiFroze, THERM_AntiFroze, true, false );
+    thermPublish( TOPIC_PowerOnMemory, thermState.powerOnMemory, THERM_PowerOnMemory, true, false );
+    thermPublish( P3(TOPIC_SetWeekday), thermState.weekday, THERM_Weekday, true, false );
+    if( thermDirty & THERM_Time ) {
       sprintf(s,"%02d:%02d", thermState.hours, thermState.minutes );
-      if( mqttPublish( P3(TOPIC_SetTime), s, true)) {
-        _thermState.hours = thermState.hours;
-        _thermState.minutes = thermState.minutes;
-        thermLastPublished = millis();
+      thermPublish( P3(TOPIC_SetTime), s, true, THERM_Time, true, false );
+    }
+    if( thermDirty & THERM_Schedule ) {
+      thermPrintSchedule(s,thermState.schedule, 6);
+      if( strlen(s)>0 ) {
+        thermPublish( P3(TOPIC_SetSchedule), s, true, THERM_Schedule, true, false );
+      } else {
+        thermDirty &= ~THERM_Schedule;
       }
     }
-    thermPrintSchedule(s,thermState.schedule, 6);
-    thermPrintSchedule(s1,_thermState.schedule, 6);
-    if( (strlen(s)>0) && (strcmp(s, s1)!=0) ) {
-      if( mqttPublish( P3(TOPIC_SetSchedule), s, true)) {
-        memcpy(_thermState.schedule, thermState.schedule, sizeof(_thermState.schedule));
-        thermLastPublished = millis();
+    if( thermDirty & THERM_Schedule2 ) {
+      thermPrintSchedule(s,thermState.schedule2, 2);
+      if( strlen(s)>0 ) {
+        thermPublish( P3(TOPIC_SetSchedule2), s, true, THERM_Schedule2, true, false );
+      } else {
+        thermDirty &= ~THERM_Schedule2;
       }
     }
 
-    thermPrintSchedule(s,thermState.schedule2, 2);
-    thermPrintSchedule(s1,_thermState.schedule2, 2);
-    if( (strlen(s)>0) && (strcmp(s, s1)!=0) ) {
-      if( mqttPublish( P3(TOPIC_SetSchedule2), s, true)) {
-        memcpy(_thermState.schedule2, thermState.schedule2, sizeof(_thermState.schedule2));
-        thermLastPublished = millis();
+    if( thermDirty & THERM_HAMode ) {
+      int haMode, hAction;
+      if (!thermState.power) {
+          haMode = 0; // off
+          hAction = 0; // off
+      } else {
+          // Auto / Heat
+          haMode = thermState.autoMode ? 2 : 1;
+          
+          // Heat / Idle
+          hAction = thermState.heating ? 2 : 1;
+      }
+      if( thermPublishValue(P3(TOPIC_SetHAMode), HAMODE(haMode), true, true) 
+          && thermPublishValue(TOPIC_HAction, HACTION(hAction), true, true) ) {
+        thermDirty &= ~THERM_HAMode;
       }
     }
 
-    static int _haMode = -1;
-    static int _hAction = -1;
-    int haMode, hAction;
-    if (!thermState.power) {
-        haMode = 0; // off
-        hAction = 0; // off
-    } else {
-        // Auto / Heat
-        haMode = thermState.autoMode ? 2 : 1;
-        
-        // Heat / Idle
-        hAction = thermState.heating ? 2 : 1;
-    }
-    if( (_haMode != haMode) && mqttPublish(P3(TOPIC_SetHAMode), HAMODE(haMode),true) ) {
-        _haMode = haMode;
-    }
-    if ((_hAction != hAction) && mqttPublish(TOPIC_HAction, HACTION(hAction), true)) {
-        _hAction = hAction;
+    if( thermDirty & THERM_Latency ) {
+      if( mqttPublish( TOPIC_Latency, thermPrintLatency( s ), false ) ) {
+        thermDirty &= ~THERM_Latency;
+      }
     }
 
+    if( thermDirty & THERM_Energy ) {
+      if( thermLastHour.time == 0 ) {
+        thermDirty &= ~THERM_Energy;
+      } else {
+        // {"hour":{last completed hour},"day":{last completed day or current one so far}}
+        char json[THERM_JsonSize];
+        strcpy( json, "{\"hour\":" );
+        thermPrintEnergy( json + strlen(json), &thermLastHour );
+        strcat( json, ",\"day\":" );
+        thermPrintEnergy( json + strlen(json), thermDayCompleted ? &thermLastDay : &thermDay );
+        strcat( json, "}" );
+        if( mqttPublish( TOPIC_Energy, json, true ) ) thermDirty &= ~THERM_Energy;
+      }
+    }
+    thermPublish( P3(TOPIC_SetHeaterPower), thermConfig.heaterPower, THERM_HeaterPower, true, false );
 
-
-#ifdef USE_HTU21D
-    static int _autoAdjMode = 99;
-    if( _autoAdjMode != thermConfig.autoAdjMode ) {
-      if( mqttPublish( P3(TOPIC_SetAutoAdjMode), thermConfig.autoAdjMode, true)) {
-        _autoAdjMode = thermConfig.autoAdjMode;
-        thermLastPublished = millis();
+    // Outgoing queue backpressure
+    if( thermDirty & THERM_TxStats ) {
+      if( mqttPublish( TOPIC_TxQueue, thermTxMax, false ) && mqttPublish( TOPIC_TxDropped, thermTxDropped, false ) ) {
+        thermDirty &= ~THERM_TxStats;
       }
     }
+
+#ifdef USE_HTU21D
+    thermPublish( P3(TOPIC_SetAutoAdjMode), thermConfig.autoAdjMode, THERM_AutoAdjMode, true, false );
+#else
+    thermDirty &= ~THERM_AutoAdjMode;
 #endif
+    thermJsonFlush();
+}
+#pragma endregion
+
+#pragma region Benchmark
+#ifdef THERM_BENCHMARK
+bool mqttDispatch( char* name, byte* payload, unsigned int length );
+
+// Status reply with all 22 registers and valid CRC
+static const uint8 thermBenchFrame[] = {
+  0x01, 0x03, 0x2c,
+  0x00, 0x11, 0x2a, 0x2c, 0x01, 0x00, 0x23, 0x01, 0x23, 0x05, 0x00, 0x00, 0x00, 0x01, 0x00, 0x2c,
+  0x0c, 0x00, 0x00, 0x01,
+  0x06, 0x00, 0x08, 0x00, 0x0b, 0x1e, 0x0c, 0x1e, 0x11, 0x00, 0x16, 0x00, 0x08, 0x00, 0x17, 0x00,
+  0x28, 0x1e, 0x1e, 0x1e, 0x2c, 0x1e, 0x2c, 0x1e,
+  0x10, 0x66
+};
+
+char* thermBenchJson;
+uint32 thermBenchHeapMin;
+
+void thermBenchResult( const char* name, unsigned long elapsed, int iterations ) {
+  uint32 heap = ESP.getFreeHeap();
+  if( heap < thermBenchHeapMin ) thermBenchHeapMin = heap;
+  sprintf( thermBenchJson + strlen(thermBenchJson), "\"%s\":%lu,", name, (unsigned long)(elapsed * 1000UL / iterations) );
+  yield();
+}
+
+// Run code given number of times and add ns/op to results
+#define THERM_BENCH_N( name, iterations, code ) { \
+  unsigned long _t = micros(); \
+  for( int _i=0; _i<(iterations); _i++ ) { code; } \
+  thermBenchResult( name, micros() - _t, (iterations) ); \
+}
+#define THERM_BENCH( name, code ) THERM_BENCH_N( name, THERM_BenchIterations, code )
+
+// Publish whole state as after MQTT reconnect, bypassing publishing rate limit
+void thermBenchPublish() {
+  thermDirty = THERM_All;
+  thermLastPublished = millis() - 1000;
+  thermPublish();
+}
+
+// Parse one of two different schedules in turn, so that every call stores changed records
+char thermBenchSchedule[] = "06:00 21;08:00 15;11:30 15;12:30 15;17:00 22;22:00 16";
+char thermBenchSchedule2[] = "07:00 22;09:00 16;12:00 16;13:00 16;18:00 23;23:00 17";
+void thermBenchParseSchedule( ThermScheduleRecord schedule[] ) {
+  static bool other = false;
+  char* s = other ? thermBenchSchedule2 : thermBenchSchedule;
+  other = !other;
+  thermParseSchedule( s, strlen(s), schedule, 6 );
+}
 
+// Measure hot paths on device and publish ns/op, free heap low-water mark and
+// free stack high-water mark as JSON document to Stats/Bench.
+// Thermostat state and outgoing queue are restored after the run
+void thermOnRunBenchmark( byte* payload, unsigned int length ) {
+  char json[256];
+  char topic[64];
+  char s[128];
+  ThermState state = thermState;
+  ThermConfig config = thermConfig;
+  uint32 dirty = thermDirty;
+  unsigned long lastStatus = thermLastStatus;
+  unsigned long lastPublished = thermLastPublished;
+  unsigned long lastStatusRequest = thermLastStatusRequest;
+  unsigned long pollInterval = thermPollInterval;
+  bool refreshPending = thermRefreshPending;
+  unsigned long lastWrite = thermLastWrite;
+  uint32 pendingWrites = thermPendingWrites;
+  uint32 writtenFlags = thermWrittenFlags;
+  unsigned long activityLocked = thermActivityLocked;
+  uint8 txCount = thermTxCount;
+  uint8 txMax = thermTxMax;
+  unsigned long txDropped = thermTxDropped;
+  ThermTrace traces[THERM_TraceSize];
+  ThermLatency latency = thermLatency;
+  ThermEnergy hour = thermHour;
+  ThermEnergy day = thermDay;
+  ThermEnergy lastHour = thermLastHour;
+  ThermEnergy lastDay = thermLastDay;
+  bool dayCompleted = thermDayCompleted;
+  int energyHour = thermEnergyHour;
+  memcpy( traces, thermTraces, sizeof(traces) );
+  ThermScheduleRecord schedule[6];
+
+  strcpy( json, "{" );
+  thermBenchJson = json;
+  thermBenchHeapMin = ESP.getFreeHeap();
+  // Keep auto adjustment from sending commands
+  thermConfig.autoAdjMode = 0;
+
+  THERM_BENCH( "crc", thermCRC16( thermBenchFrame, sizeof(thermBenchFrame) - 2 ) );
+  THERM_BENCH( "processMessage", thermProcessMessage( thermBenchFrame, sizeof(thermBenchFrame) ) );
+  THERM_BENCH_N( "publish", THERM_BenchPublishIterations, thermBenchPublish() );
+  THERM_BENCH( "dispatchMiss", mqttDispatch( (char*)"Benchmark", NULL, 0 ) );
+  // Registered topic, handler ignores empty payload
+  THERM_BENCH( "dispatchHit", mqttDispatch( TOPIC_SetTargetTemp, NULL, 0 ) );
+  THERM_BENCH( "mqttTopic", mqttTopic( topic, TOPIC_State ) );
+  memcpy( schedule, thermState.schedule, sizeof(schedule) );
+  THERM_BENCH( "printSchedule", thermPrintSchedule( s, schedule, 6 ) );
+  THERM_BENCH( "parseSchedule", thermBenchParseSchedule( schedule ) );
+
+  thermState = state;
+  thermConfig = config;
+  thermDirty = dirty;
+  thermLastStatus = lastStatus;
+  thermLastPublished = lastPublished;
+  thermLastStatusRequest = lastStatusRequest;
+  thermPollInterval = pollInterval;
+  thermRefreshPending = refreshPending;
+  thermLastWrite = lastWrite;
+  thermPendingWrites = pendingWrites;
+  thermWrittenFlags = writtenFlags;
+  thermActivityLocked = activityLocked;
+  thermTxCount = txCount;
+  thermTxMax = txMax;
+  thermTxDropped = txDropped;
+  memcpy( thermTraces, traces, sizeof(traces) );
+  thermLatency = latency;
+  thermHour = hour;
+  thermDay = day;
+  thermLastHour = lastHour;
+  thermLastDay = lastDay;
+  thermDayCompleted = dayCompleted;
+  thermEnergyHour = energyHour;
+
+  sprintf( json + strlen(json), "\"heapMin\":%u,\"stackFree\":%u}", (unsigned int)thermBenchHeapMin, (unsigned int)ESP.getFreeContStack() );
+  mqttPublish( TOPIC_Bench, json, false );
 }
+#endif
 #pragma endregion
 
 #pragma region Init & Loop
+bool thermAvailable() {
+  return (thermLastStatus != 0) && ((unsigned long)(millis() - thermLastStatus) < THERM_StatusTimeout);
+}
+
 void thermLoop() {
+	unsigned long t = millis();
+
+  // Keep draining outgoing queue even if disabled to let pending frames reach MCU
+  thermTxLoop( t );
   if(thermDisabled) return;
   
-  static unsigned long lastRead = 0;
   static unsigned long lastMaintenance = 0;
-  
-	unsigned long t = millis();
-
-  if( (thermDataLen>0) && (unsigned long)(t - lastRead) > (unsigned long)200 ) {
-    thermProcessMessage();
-    thermDataLen = 0;
-  }
 
   // Read Thermostat MCU uart
-  while (therm.available()>0) {
-    // Check buffer overflow 
-    if( thermDataLen >= sizeof(thermData)-1 ) {
-      thermProcessMessage();
-      thermDataLen=0;
-    }
+  thermRxLoop( t );
 
-    thermData[thermDataLen++] = therm.read(); 
-    lastRead = t;
-    lastMaintenance = t;
+  // Send coalesced commands once they settle
+  if( (thermPendingWrites != 0) && (((unsigned long)(t - thermLastCommand) > THERM_SettleTime)
+      || ((unsigned long)(t - thermFirstCommand) > THERM_SettleMax)) ) {
+    thermFlushWrites();
+  }
+
+  // Confirm write commands by status read once batch is queued
+  if( thermRefreshPending && ((unsigned long)(t - thermLastWrite) > THERM_RefreshDelay) ) {
+    thermRefreshPending = false;
+    thermReadRegisters( 0x0000, 0x0016 );
+    thermLastStatusRequest = t;
   }
+  // Postpone maintenance while MCU is talking
+  if( (unsigned long)(t - thermLastRead) < (unsigned long)(t - lastMaintenance) ) lastMaintenance = thermLastRead;
 
   // Periodical maintenance tasks
   if( (unsigned long)(t - lastMaintenance) > (unsigned long)500 ) {
     //*** Thermostat time validation
     tm* lt = commsGetTime();
     
-    if( mqttConnected() && (lt!=NULL) ) {
+    if( mqttConnected() && (lt!=NULL) && (thermLastStatus != 0) && ((unsigned long)(t - thermLastStatus) < THERM_TimeCheckAge) ) {
       int weekday = (lt->tm_wday>0) ? lt->tm_wday : 7;
       
       unsigned long tc =  ((( weekday * 24 ) + lt->tm_hour) * 60 + lt->tm_min) * 60 + lt->tm_sec;
@@ -790,19 +1564,17 @@ void thermLoop() {
       // If more than 20 seconds difference:
       if( ((tc<tt)?(tt-tc):(tc-tt)) > 20 ) {
           thermActivityLocked = millis();
-          thermState.hours = lt->tm_hour;
-          thermState.minutes = lt->tm_min;
+          THERM_SET( hours, THERM_Time, lt->tm_hour );
+          THERM_SET( minutes, THERM_Time, lt->tm_min );
           thermState.seconds = lt->tm_sec;
-          thermState.weekday = weekday;
-          char s[31];
-          sprintf(s, "01100008000204%02x%02x%02x%02x", thermState.hours, thermState.minutes, thermState.seconds, thermState.weekday );
-          thermSendMessage( s );
+          THERM_SET( weekday, THERM_Weekday, weekday );
+          thermQueueWrite( THERM_WriteTime );
       }
     }
 
     // Get MCU status every few seconds
-    if( (unsigned long)(t - thermLastStatusRequest) > (unsigned long)4000 ) {
-      thermSendMessage( "010300000016");
+    if( (unsigned long)(t - thermLastStatusRequest) > thermPollInterval ) {
+      thermReadRegisters( 0x0000, 0x0016 );
       thermLastStatusRequest = t;
     } else {
       static char _wifiState = 99;
@@ -827,8 +1599,33 @@ void thermInit() {
   storageRegisterBlock('T', &thermConfig, sizeof(thermConfig));
   thermActivityLocked = millis();
   therm.begin(9600);
-  mqttRegisterCallbacks( thermCallback, thermConnect );
-  registerLoop(thermLoop);
+
+  mqttRegisterTopic( TOPIC_SetTargetTemp, thermOnSetTargetTemp );
+  mqttRegisterTopic( TOPIC_SetPower, thermOnSetPower );
+  mqttRegisterTopic( TOPIC_SetLocked, thermOnSetLocked );
+  mqttRegisterTopic( TOPIC_SetAutoMode, thermOnSetAutoMode );
+  mqttRegisterTopic( TOPIC_SetLoopMode, thermOnSetLoopMode );
+  mqttRegisterTopic( TOPIC_SetSchedule, thermOnSetSchedule );
+  mqttRegisterTopic( TOPIC_SetSchedule2, thermOnSetSchedule2 );
+  mqttRegisterTopic( TOPIC_SetTime, thermOnSetTime );
+  mqttRegisterTopic( TOPIC_SetWeekday, thermOnSetWeekday );
+  mqttRegisterTopic( TOPIC_SetSensor, thermOnSetSensor );
+  mqttRegisterTopic( TOPIC_SetAdjTemp, thermOnSetAdjTemp );
+  mqttRegisterTopic( TOPIC_SetAntiFroze, thermOnSetAntiFroze );
+  mqttRegisterTopic( TOPIC_SetFloorTempMax, thermOnSetFloorTempMax );
+  mqttRegisterTopic( TOPIC_SetHAMode, thermOnSetHAMode );
+  mqttRegisterTopic( TOPIC_SetHeaterPower, thermOnSetHeaterPower );
+#ifdef USE_HTU21D
+  mqttRegisterTopic( TOPIC_SetAutoAdjMode, thermOnSetAutoAdjMode );
+#endif
+  mqttRegisterTopic( TOPIC_EnableOTA, thermOnEnableOTA );
+#ifdef THERM_BENCHMARK
+  mqttRegisterTopic( TOPIC_RunBenchmark, thermOnRunBenchmark );
+#endif
+  mqttRegisterCallbacks( NULL, thermConnect );
+  scheduleEvery( THERM_LoopInterval, thermLoop, "therm" );
+  // Read MCU replies as soon as they arrive
+  scheduleOnEvent( [](){ return !thermDisabled && (therm.available()>0); }, [](){ thermRxLoop( millis() ); }, "thermRx" );
 }
 
 #pragma endregion
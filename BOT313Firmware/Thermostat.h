@@ -3,6 +3,8 @@
 
 struct ThermConfig {
     int autoAdjMode = 0;
+    // Heater power, W. Used to estimate energy consumption
+    int heaterPower = 0;
 };
 
 extern ThermConfig thermConfig;
@@ -50,5 +52,8 @@ extern ThermState thermState;
 //MCU_DEBUG only!!!
 void thermSendMessage( const char* data);
 
+// TRUE if thermState is refreshed by MCU status recently
+bool thermAvailable();
+
 void thermInit();
 #endif
@@ -0,0 +1,31 @@
+// Host run of RunBenchmark: firmware receives real status frames from simulated MCU first,
+// then hot paths are measured on real time clock. Prints JSON document published to Stats/Bench
+#include <Arduino.h>
+#include <string>
+#include "Host.h"
+#include "Config.h"
+#include "Thermostat.h"
+#include "Test.h"
+
+int main() {
+  hostMqttConnect( true );
+  setup();
+  testRun( 10000 );
+  if( !thermAvailable() ) {
+    printf( "Thermostat MCU is not available\n" );
+    return 1;
+  }
+  hostMqttMessages().clear();
+
+  hostRealTime( true );
+  testSend( "RunBenchmark", "" );
+  hostRealTime( false );
+
+  for( HostMessage& m : hostMqttMessages() ) {
+    if( m.topic.find( "/Stats/Bench" ) == std::string::npos ) continue;
+    printf( "%s\n", m.payload.c_str() );
+    return 0;
+  }
+  printf( "No Stats/Bench results\n" );
+  return 1;
+}
@@ -0,0 +1,102 @@
+#ifndef arduino_h
+#define arduino_h
+// Subset of ESP8266 Arduino core API used by firmware sources, to build and test them on host.
+// See Host.h for the functions tests use to drive the clock and inspect flash and MQTT traffic.
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <math.h>
+#include <time.h>
+#include <functional>
+#include <algorithm>
+
+typedef uint8_t uint8;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+typedef int8_t int8;
+typedef int16_t int16;
+typedef int32_t int32;
+typedef uint8_t byte;
+typedef bool boolean;
+
+using std::min;
+using std::max;
+
+#define PROGMEM
+#define F(s) (s)
+#define PSTR(s) (s)
+#define pgm_read_byte(p) (*(const uint8_t*)(p))
+#define pgm_read_word(p) (*(const uint16_t*)(p))
+#define pgm_read_dword(p) (*(const uint32_t*)(p))
+#define pgm_read_float(p) (*(const float*)(p))
+#define memcpy_P memcpy
+
+#define LOW 0
+#define HIGH 1
+#define INPUT 0
+#define OUTPUT 1
+
+// Host clock: stands still until delay() or hostAdvance() moves it, see hostRealTime()
+unsigned long millis();
+unsigned long micros();
+void delay( unsigned long ms );
+void yield();
+
+void pinMode( uint8_t pin, uint8_t mode );
+void digitalWrite( uint8_t pin, uint8_t value );
+int digitalRead( uint8_t pin );
+
+long random( long max );
+long random( long min, long max );
+void randomSeed( unsigned long seed );
+char* dtostrf( double value, signed char width, unsigned char precision, char* buffer );
+
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write( uint8_t c ) = 0;
+  virtual size_t write( const uint8_t* buffer, size_t size );
+  size_t printf( const char* format, ... );
+  size_t print( const char* s );
+  size_t print( long value );
+  size_t println( const char* s = "" );
+  size_t println( long value );
+};
+
+class Stream : public Print {
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+  virtual void flush() {}
+};
+
+// Bytes written are discarded, bytes queued by hostSerialInput() are read back
+class HardwareSerial : public Stream {
+public:
+  void begin( unsigned long baud ) {}
+  void end() {}
+  int available() override;
+  int read() override;
+  int peek() override;
+  size_t write( uint8_t c ) override { return 1; }
+  using Print::write;
+};
+extern HardwareSerial Serial;
+
+// Flash is kept in memory, see hostFlash()
+class EspClass {
+public:
+  uint32_t getFreeHeap();
+  uint32_t getFreeContStack();
+  bool flashEraseSector( uint32_t sector );
+  bool flashWrite( uint32_t offset, uint32_t* data, size_t size );
+  bool flashRead( uint32_t offset, uint32_t* data, size_t size );
+  void restart();
+};
+extern EspClass ESP;
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef arduinoota_h
+#define arduinoota_h
+#include <Arduino.h>
+
+typedef int ota_error_t;
+#define OTA_AUTH_ERROR 0
+#define OTA_BEGIN_ERROR 1
+#define OTA_CONNECT_ERROR 2
+#define OTA_RECEIVE_ERROR 3
+#define OTA_END_ERROR 4
+
+class ArduinoOTAClass {
+public:
+  void setHostname( const char* name ) {}
+  void setPassword( const char* password ) {}
+  void onStart( std::function<void()> fn ) {}
+  void onEnd( std::function<void()> fn ) {}
+  void onError( std::function<void(ota_error_t)> fn ) {}
+  void onProgress( std::function<void(unsigned int, unsigned int)> fn ) {}
+  void begin() {}
+  void handle() {}
+};
+extern ArduinoOTAClass ArduinoOTA;
+
+#endif
@@ -0,0 +1,3 @@
+// Placeholder for private WiFi credentials file
+#define WIFI_SSID "host"
+#define WIFI_Password "host"
@@ -0,0 +1,43 @@
+#ifndef esp8266wifi_h
+#define esp8266wifi_h
+#include <Arduino.h>
+
+#define WIFI_OFF 0
+#define WIFI_STA 1
+#define WL_IDLE_STATUS 0
+#define WL_CONNECTED 3
+#define WL_DISCONNECTED 6
+
+class IPAddress {
+public:
+  IPAddress() : address(0) {}
+  IPAddress( uint32_t address ) : address(address) {}
+  IPAddress( uint8_t a, uint8_t b, uint8_t c, uint8_t d ) : address(a | (b << 8) | (c << 16) | ((uint32_t)d << 24)) {}
+  uint8_t operator[]( int i ) const { return (uint8_t)(address >> (i*8)); }
+  operator uint32_t() const { return address; }
+private:
+  uint32_t address;
+};
+
+class WiFiClient {
+};
+
+// Station which is always connected
+class ESP8266WiFiClass {
+public:
+  int mode( int mode ) { return 1; }
+  void persistent( bool persistent ) {}
+  int begin( const char* ssid, const char* password ) { return WL_CONNECTED; }
+  bool disconnect( bool wifiOff = false ) { return true; }
+  int status() { return WL_CONNECTED; }
+  bool hostname( const char* name ) { return true; }
+  const char* getHostname() { return "host"; }
+  IPAddress localIP() { return IPAddress( 127, 0, 0, 1 ); }
+  int32_t RSSI() { return -50; }
+  uint8_t* macAddress( uint8_t* mac ) { for( int i=0; i<6; i++ ) mac[i] = i; return mac; }
+};
+extern ESP8266WiFiClass WiFi;
+
+void configTime( const char* tz, const char* server1, const char* server2 = NULL, const char* server3 = NULL );
+
+#endif
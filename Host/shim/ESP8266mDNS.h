@@ -0,0 +1,16 @@
+#ifndef esp8266mdns_h
+#define esp8266mdns_h
+#include <ESP8266WiFi.h>
+
+// Responder which finds single service on local host: MQTT broker of the shim
+class MDNSResponder {
+public:
+  bool begin( const char* hostName ) { return true; }
+  void end() {}
+  int queryService( const char* service, const char* protocol ) { return 1; }
+  IPAddress IP( int i ) { return IPAddress( 127, 0, 0, 1 ); }
+  uint16_t port( int i ) { return 1883; }
+};
+extern MDNSResponder MDNS;
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef host_h
+#define host_h
+#include <Arduino.h>
+#include <string>
+#include <vector>
+
+// Flash size and layout of 1MB module with "FS:64KB" (see CMakeLists.txt for linker symbols)
+#define HOST_FlashSize (1024*1024)
+#define HOST_SectorSize 4096
+// UNIX time at power on: 2026-01-01 12:00:00 UTC
+#define HOST_Epoch 1767268800
+
+struct HostMessage {
+  std::string topic;
+  std::string payload;
+  bool retained;
+};
+
+// Move host clock forward
+void hostAdvance( unsigned long ms );
+// Let host clock follow real time, e.g. to measure code with micros(). Stands still by default
+void hostRealTime( bool enabled );
+// Raw flash content, erased flash reads as 0xFF
+uint8_t* hostFlash();
+// Fill whole flash with 0xFF
+void hostFlashErase();
+// Run firmware from power on in child process which shares flash with the caller and
+// returns exit code of run(). Firmware keeps its state in globals, so every boot needs
+// its own process
+int hostBoot( std::function<int()> run );
+// Exit code of hostBoot() when power is lost
+#define HOST_PowerLoss 99
+// Lose power right before the given flash erase or write operation of this boot, 0 to cancel
+void hostPowerLossAfter( int operations );
+// Number of ESP.restart() calls
+int hostRestarts();
+// Queue bytes to be read from Serial
+void hostSerialInput( const uint8_t* data, size_t size );
+
+// Make MQTT broker reachable (firmware connects to it on its own) or drop the connection.
+// Messages published through PubSubClient are recorded
+void hostMqttConnect( bool connected );
+std::vector<HostMessage>& hostMqttMessages();
+
+#endif
@@ -0,0 +1,4 @@
+#ifndef littlefs_h
+#define littlefs_h
+// Firmware does not mount file system, FS area is used by Storage journal
+#endif
@@ -0,0 +1,26 @@
+#ifndef pubsubclient_h
+#define pubsubclient_h
+#include <ESP8266WiFi.h>
+
+#define MQTT_CALLBACK_SIGNATURE std::function<void(char*, uint8_t*, unsigned int)> callback
+
+// Client which records published messages, see hostMqttMessages()
+class PubSubClient {
+public:
+  PubSubClient( WiFiClient& client ) {}
+  PubSubClient& setServer( IPAddress ip, uint16_t port ) { return *this; }
+  PubSubClient& setServer( const char* domain, uint16_t port ) { return *this; }
+  PubSubClient& setCallback( MQTT_CALLBACK_SIGNATURE ) { return *this; }
+  bool connect( const char* id, const char* willTopic, uint8_t willQos, bool willRetain, const char* willMessage );
+  void disconnect();
+  bool connected();
+  int state() { return connected() ? 0 : -1; }
+  bool loop() { return connected(); }
+  bool subscribe( const char* topic ) { return connected(); }
+  bool publish( const char* topic, const char* payload, bool retained );
+  bool beginPublish( const char* topic, unsigned int length, bool retained );
+  size_t write( const uint8_t* buffer, size_t size );
+  int endPublish();
+};
+
+#endif
@@ -0,0 +1,298 @@
+#include <Arduino.h>
+#include <chrono>
+#include <deque>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <ESP8266WiFi.h>
+#include <ESP8266mDNS.h>
+#include <ArduinoOTA.h>
+#include <PubSubClient.h>
+#include <Wire.h>
+#include "Host.h"
+
+HardwareSerial Serial;
+EspClass ESP;
+TwoWire Wire;
+ESP8266WiFiClass WiFi;
+MDNSResponder MDNS;
+ArduinoOTAClass ArduinoOTA;
+
+//**************************************************************************
+//                            Time
+//**************************************************************************
+// Starts above zero: firmware uses 0 as "never happened"
+static unsigned long hostMicros = 1000000;
+// Real time clock mode: real time passed since hostRealStart is added to hostMicros
+static bool hostRealClock = false;
+static std::chrono::steady_clock::time_point hostRealStart;
+
+unsigned long millis() {
+  return micros() / 1000;
+}
+
+unsigned long micros() {
+  if( !hostRealClock ) return hostMicros;
+  return hostMicros + std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now() - hostRealStart ).count();
+}
+
+void delay( unsigned long ms ) {
+  hostAdvance( ms );
+}
+
+void yield() {
+}
+
+void hostAdvance( unsigned long ms ) {
+  hostMicros += ms * 1000;
+}
+
+void hostRealTime( bool enabled ) {
+  hostMicros = micros();
+  hostRealClock = enabled;
+  hostRealStart = std::chrono::steady_clock::now();
+}
+
+void configTime( const char* tz, const char* server1, const char* server2, const char* server3 ) {
+}
+
+// Wall clock follows host clock as if NTP time was received on power on
+time_t time( time_t* t ) {
+  time_t now = HOST_Epoch + millis() / 1000;
+  if( t != NULL ) *t = now;
+  return now;
+}
+
+//**************************************************************************
+//                            GPIO and helpers
+//**************************************************************************
+static uint8_t hostPins[32];
+
+void pinMode( uint8_t pin, uint8_t mode ) {
+}
+
+void digitalWrite( uint8_t pin, uint8_t value ) {
+  if( pin < sizeof(hostPins) ) hostPins[pin] = value;
+}
+
+int digitalRead( uint8_t pin ) {
+  return (pin < sizeof(hostPins)) ? hostPins[pin] : LOW;
+}
+
+long random( long max ) {
+  return (max > 0) ? rand() % max : 0;
+}
+
+long random( long min, long max ) {
+  return (max > min) ? min + rand() % (max - min) : min;
+}
+
+void randomSeed( unsigned long seed ) {
+  srand( seed );
+}
+
+char* dtostrf( double value, signed char width, unsigned char precision, char* buffer ) {
+  sprintf( buffer, "%*.*f", width, precision, value );
+  return buffer;
+}
+
+//**************************************************************************
+//                            Serial
+//**************************************************************************
+size_t Print::write( const uint8_t* buffer, size_t size ) {
+  for( size_t i=0; i<size; i++ ) write( buffer[i] );
+  return size;
+}
+
+size_t Print::printf( const char* format, ... ) {
+  char buffer[256];
+  va_list args;
+  va_start( args, format );
+  vsnprintf( buffer, sizeof(buffer), format, args );
+  va_end( args );
+  return write( (const uint8_t*)buffer, strlen(buffer) );
+}
+
+size_t Print::print( const char* s ) {
+  return write( (const uint8_t*)s, strlen(s) );
+}
+
+size_t Print::print( long value ) {
+  return printf( "%ld", value );
+}
+
+size_t Print::println( const char* s ) {
+  return print( s ) + print( "\r\n" );
+}
+
+size_t Print::println( long value ) {
+  return print( value ) + print( "\r\n" );
+}
+
+static std::deque<uint8_t> hostSerial;
+
+void hostSerialInput( const uint8_t* data, size_t size ) {
+  hostSerial.insert( hostSerial.end(), data, data + size );
+}
+
+int HardwareSerial::available() {
+  return hostSerial.size();
+}
+
+int HardwareSerial::read() {
+  if( hostSerial.empty() ) return -1;
+  int c = hostSerial.front();
+  hostSerial.pop_front();
+  return c;
+}
+
+int HardwareSerial::peek() {
+  return hostSerial.empty() ? -1 : hostSerial.front();
+}
+
+//**************************************************************************
+//                            Flash
+//**************************************************************************
+// Shared with processes started by hostBoot()
+static uint8_t* hostFlashData = NULL;
+static int hostRestartCount = 0;
+
+uint8_t* hostFlash() {
+  if( hostFlashData == NULL ) {
+    hostFlashData = (uint8_t*)mmap( NULL, HOST_FlashSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+    if( hostFlashData == MAP_FAILED ) abort();
+    hostFlashErase();
+  }
+  return hostFlashData;
+}
+
+void hostFlashErase() {
+  memset( hostFlash(), 0xFF, HOST_FlashSize );
+}
+
+int hostBoot( std::function<int()> run ) {
+  hostFlash();
+  fflush( stdout );
+  fflush( stderr );
+  pid_t pid = fork();
+  if( pid < 0 ) return -1;
+  if( pid == 0 ) {
+    int result = run();
+    fflush( stdout );
+    fflush( stderr );
+    _exit( result );
+  }
+  int status;
+  if( waitpid( pid, &status, 0 ) != pid ) return -1;
+  return WIFEXITED( status ) ? WEXITSTATUS( status ) : -1;
+}
+
+int hostRestarts() {
+  return hostRestartCount;
+}
+
+uint32_t EspClass::getFreeHeap() {
+  return 40000;
+}
+
+uint32_t EspClass::getFreeContStack() {
+  return 3000;
+}
+
+// Flash erase and write operations left before power loss, 0: never
+static int hostPowerLoss = 0;
+
+void hostPowerLossAfter( int operations ) {
+  hostPowerLoss = operations;
+}
+
+// Power is lost right before the operation, boot process ends with HOST_PowerLoss
+static void hostFlashOperation() {
+  if( (hostPowerLoss > 0) && (--hostPowerLoss == 0) ) {
+    fflush( stdout );
+    _exit( HOST_PowerLoss );
+  }
+}
+
+bool EspClass::flashEraseSector( uint32_t sector ) {
+  hostFlashOperation();
+  if( (sector + 1) * HOST_SectorSize > HOST_FlashSize ) return false;
+  memset( hostFlash() + sector * HOST_SectorSize, 0xFF, HOST_SectorSize );
+  return true;
+}
+
+// NOR flash: writing can only clear bits, offset and size must be aligned
+bool EspClass::flashWrite( uint32_t offset, uint32_t* data, size_t size ) {
+  hostFlashOperation();
+  if( (offset & 3) || (size & 3) || (offset + size > HOST_FlashSize) ) return false;
+  uint8_t* p = hostFlash() + offset;
+  for( size_t i=0; i<size; i++ ) p[i] &= ((uint8_t*)data)[i];
+  return true;
+}
+
+bool EspClass::flashRead( uint32_t offset, uint32_t* data, size_t size ) {
+  if( (offset & 3) || (size & 3) || (offset + size > HOST_FlashSize) ) return false;
+  memcpy( data, hostFlash() + offset, size );
+  return true;
+}
+
+void EspClass::restart() {
+  hostRestartCount++;
+}
+
+//**************************************************************************
+//                            MQTT
+//**************************************************************************
+// Broker is reachable; client is connected once firmware calls connect()
+static bool hostMqttBroker = false;
+static bool hostMqttIsConnected = false;
+static std::vector<HostMessage> hostMqttLog;
+static HostMessage hostMqttPending;
+static unsigned int hostMqttPendingLength = 0;
+
+void hostMqttConnect( bool connected ) {
+  hostMqttBroker = connected;
+  if( !connected ) hostMqttIsConnected = false;
+}
+
+std::vector<HostMessage>& hostMqttMessages() {
+  return hostMqttLog;
+}
+
+bool PubSubClient::connect( const char* id, const char* willTopic, uint8_t willQos, bool willRetain, const char* willMessage ) {
+  hostMqttIsConnected = hostMqttBroker;
+  return hostMqttIsConnected;
+}
+
+void PubSubClient::disconnect() {
+  hostMqttIsConnected = false;
+}
+
+bool PubSubClient::connected() {
+  return hostMqttIsConnected;
+}
+
+bool PubSubClient::publish( const char* topic, const char* payload, bool retained ) {
+  if( !hostMqttIsConnected ) return false;
+  hostMqttLog.push_back( { topic, payload, retained } );
+  return true;
+}
+
+bool PubSubClient::beginPublish( const char* topic, unsigned int length, bool retained ) {
+  if( !hostMqttIsConnected ) return false;
+  hostMqttPending = { topic, "", retained };
+  hostMqttPendingLength = length;
+  return true;
+}
+
+size_t PubSubClient::write( const uint8_t* buffer, size_t size ) {
+  hostMqttPending.payload.append( (const char*)buffer, size );
+  return size;
+}
+
+// Payload shorter or longer than announced by beginPublish() breaks MQTT stream
+int PubSubClient::endPublish() {
+  if( hostMqttPending.payload.size() != hostMqttPendingLength ) return 0;
+  hostMqttLog.push_back( hostMqttPending );
+  return 1;
+}
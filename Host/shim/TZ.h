@@ -0,0 +1,4 @@
+#ifndef tz_h
+#define tz_h
+#define TZ_Europe_Moscow PSTR("MSK-3")
+#endif
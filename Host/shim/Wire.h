@@ -0,0 +1,18 @@
+#ifndef wire_h
+#define wire_h
+#include <Arduino.h>
+
+// I2C bus without devices: every transfer fails as if sensor is not connected
+class TwoWire {
+public:
+  void begin( int sda, int scl ) {}
+  void beginTransmission( uint8_t address ) {}
+  size_t write( uint8_t data ) { return 1; }
+  uint8_t endTransmission( bool stop = true ) { return 2; }
+  uint8_t requestFrom( uint8_t address, uint8_t count ) { return 0; }
+  int available() { return 0; }
+  int read() { return -1; }
+};
+extern TwoWire Wire;
+
+#endif
@@ -0,0 +1,30 @@
+// Firmware boots on host with thermostat simulator and keeps settings across reboot
+#include <Arduino.h>
+#include "Host.h"
+#include "Config.h"
+#include "Thermostat.h"
+#include "Test.h"
+
+int bootAndConfigure() {
+  setup();
+  testRun( 10000 );
+  TEST_CHECK( thermAvailable() );
+  TEST_CHECK( thermConfig.heaterPower == 0 );
+  TEST_CHECK( testSend( "SetHeaterPower", "1500" ) );
+  testRun( 10000 );
+  return testResult();
+}
+
+int bootAndCheck() {
+  setup();
+  TEST_CHECK( thermConfig.heaterPower == 1500 );
+  testRun( 10000 );
+  TEST_CHECK( thermAvailable() );
+  return testResult();
+}
+
+int main() {
+  TEST_CHECK( hostBoot( bootAndConfigure ) == 0 );
+  TEST_CHECK( hostBoot( bootAndCheck ) == 0 );
+  return testResult();
+}
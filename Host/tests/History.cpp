@@ -0,0 +1,103 @@
+// History message decodes back to readings (H1 format, see History.h). Buffer survives
+// the dump after MQTT reconnect and is emptied only by dump requested with GetHistory
+#include <Arduino.h>
+#include <string>
+#include <vector>
+#include "Host.h"
+#include "Config.h"
+#include "Thermostat.h"
+#include "Test.h"
+
+struct Reading {
+  bool key;
+  uint32_t time;
+  bool heating;
+  int values[5];
+};
+
+// Readings of H1 message, empty if message is malformed
+std::vector<Reading> decode( const std::string& p ) {
+  std::vector<Reading> result;
+  if( (p.size() < 2) || (p[0] != 'H') || (p[1] != '1') ) return result;
+  const uint8_t* d = (const uint8_t*)p.data();
+  size_t i = 2;
+  Reading r = {};
+  while( i < p.size() ) {
+    uint8_t header = d[i];
+    if( header & 0x80 ) {
+      if( i + 11 > p.size() ) return std::vector<Reading>();
+      r.key = true;
+      r.time = d[i+1] | (d[i+2] << 8) | (d[i+3] << 16) | ((uint32_t)d[i+4] << 24);
+      r.values[0] = d[i+5];
+      r.values[1] = d[i+6];
+      r.values[2] = d[i+7];
+      r.values[3] = (int16_t)(d[i+8] | (d[i+9] << 8));
+      r.values[4] = d[i+10];
+      i += 11;
+    } else {
+      // Delta record needs preceding key record
+      if( result.empty() || (i + 2 > p.size()) ) return std::vector<Reading>();
+      r.key = false;
+      r.time += d[i+1];
+      i += 2;
+      for( int v=0; v<5; v++ ) {
+        if( (header & (1 << (v+2))) == 0 ) continue;
+        if( i >= p.size() ) return std::vector<Reading>();
+        r.values[v] += (int8_t)d[i++];
+      }
+    }
+    r.heating = (header & 0x01) != 0;
+    result.push_back( r );
+  }
+  return result;
+}
+
+// History messages published since previous call
+std::vector<std::string> history() {
+  std::vector<std::string> result;
+  for( HostMessage& m : hostMqttMessages() ) {
+    if( m.topic.find( "/History" ) != std::string::npos ) result.push_back( m.payload );
+  }
+  hostMqttMessages().clear();
+  return result;
+}
+
+int main() {
+  hostMqttConnect( false );
+  setup();
+  testRun( 10 * 60000UL );
+  TEST_CHECK( thermAvailable() );
+
+  // Readings collected offline are published on connect
+  hostMqttConnect( true );
+  // Broker is tried again after COMMS_ConnectTimeout
+  testRun( 90000 );
+  std::vector<std::string> h = history();
+  TEST_CHECK( h.size() == 1 );
+  if( h.size() != 1 ) return testResult();
+  std::vector<Reading> r = decode( h[0] );
+  TEST_CHECK( (r.size() >= 10) && r[0].key );
+  for( size_t i=1; i<r.size(); i++ ) {
+    TEST_CHECK( (r[i].time > r[i-1].time) && (r[i].time - r[i-1].time <= 61) );
+  }
+  for( size_t i=0; i<r.size(); i++ ) {
+    TEST_CHECK( (r[i].values[0] >= 10*2) && (r[i].values[0] <= 30*2) && (r[i].values[2] == (int)(thermState.targetTemp*2)) );
+  }
+
+  // Nobody may be subscribed on reconnect, so requested dump still starts with the same readings
+  testSend( "GetHistory", "" );
+  testRun( 2000 );
+  std::vector<std::string> requested = history();
+  TEST_CHECK( (requested.size() == 1) && (requested[0].size() >= h[0].size()) && (requested[0].compare( 0, h[0].size(), h[0] ) == 0) );
+
+  // Requested dump empties the buffer: it starts over from a fresh key record
+  testSend( "GetHistory", "" );
+  testRun( 2000 );
+  h = history();
+  TEST_CHECK( h.size() == 1 );
+  if( h.size() == 1 ) {
+    r = decode( h[0] );
+    TEST_CHECK( (r.size() == 1) && r[0].key );
+  }
+  return testResult();
+}
@@ -0,0 +1,39 @@
+// Command latency is measured up to the status reply confirming the write, status polls
+// answered while the command waits in settle window do not complete it
+#include <Arduino.h>
+#include <string>
+#include "Host.h"
+#include "Config.h"
+#include "Thermostat.h"
+#include "Test.h"
+
+// THERM_SettleTime
+#define LATENCY_Min 300
+
+int main() {
+  hostMqttConnect( true );
+  setup();
+  testRun( 10000 );
+  TEST_CHECK( thermAvailable() );
+
+  // Commands at different phases of status poll cycle
+  for( int i=0; i<40; i++ ) {
+    char target[8];
+    sprintf( target, "%d", 20 + (i & 1) );
+    testSend( "SetTargetTemp", target );
+    testRun( 3000 + i * 100 );
+  }
+
+  int reports = 0;
+  for( HostMessage& m : hostMqttMessages() ) {
+    size_t p = m.payload.find( "\"last\":" );
+    if( (m.topic.find( "/Stats/Latency" ) == std::string::npos) || (p == std::string::npos) ) continue;
+    unsigned long last = strtoul( m.payload.c_str() + p + 7, NULL, 10 );
+    if( m.payload.find( "\"count\":0," ) == std::string::npos ) {
+      reports++;
+      TEST_CHECK( last >= LATENCY_Min );
+    }
+  }
+  TEST_CHECK( reports > 0 );
+  return testResult();
+}
@@ -0,0 +1,39 @@
+// Stats/Loop document is streamed part by part and must come as complete JSON object,
+// all unnamed tasks are reported in one "?" entry
+#include <Arduino.h>
+#include <string>
+#include "Host.h"
+#include "Config.h"
+#include "Test.h"
+
+int count( const std::string& s, const std::string& what ) {
+  int n = 0;
+  for( size_t p = s.find( what ); p != std::string::npos; p = s.find( what, p + 1 ) ) n++;
+  return n;
+}
+
+int main() {
+  hostMqttConnect( true );
+  setup();
+  // One-shot unnamed tasks
+  for( int i=0; i<8; i++ ) scheduleAt( millis() + i * 100, [](){} );
+  testRun( 130000 );
+
+  int reports = 0;
+  for( HostMessage& m : hostMqttMessages() ) {
+    if( m.topic.find( "/Stats/Loop" ) == std::string::npos ) continue;
+    const std::string& p = m.payload;
+    reports++;
+    TEST_CHECK( (p.compare( 0, 9, "{\"stall\":" ) == 0) && (p.back() == '}') );
+    TEST_CHECK( (count( p, "{" ) == 1) && (count( p, "}" ) == 1) && (count( p, "[" ) == count( p, "]" )) );
+    TEST_CHECK( (count( p, "\"therm\":[" ) == 1) && (count( p, "\"tah\":[" ) == 1) );
+    if( reports == 1 ) {
+      TEST_CHECK( count( p, "\"?\":[8," ) == 1 );
+    } else {
+      // Statistics are reset after successful report
+      TEST_CHECK( count( p, "\"?\":[0," ) == 1 );
+    }
+  }
+  TEST_CHECK( reports == 2 );
+  return testResult();
+}
@@ -0,0 +1,107 @@
+// Storage journal keeps blocks registered after the first save
+// (comms is initialized and may save before thermostat registers its config)
+#include <Arduino.h>
+#include "Host.h"
+#include "Config.h"
+#include "Storage.h"
+#include "Test.h"
+
+#define JOURNAL_Sector ((0x402FB000 - 0x40200000) / HOST_SectorSize - 1)
+#define JOURNAL_SectorMagic 0x314A4541
+
+uint32_t commsBlock = 0;
+uint32_t thermBlock = 0;
+
+// Boot order of the firmware: save triggered by MQTT connection comes before thermInit()
+int bootAndSave() {
+  storageInit();
+  storageRegisterBlock( 'C', &commsBlock, sizeof(commsBlock) );
+  storageSave();
+  storageRegisterBlock( 'T', &thermBlock, sizeof(thermBlock) );
+  return 0;
+}
+
+int firstBoot() {
+  storageInit();
+  storageRegisterBlock( 'C', &commsBlock, sizeof(commsBlock) );
+  storageRegisterBlock( 'T', &thermBlock, sizeof(thermBlock) );
+  commsBlock = 0x11111111;
+  thermBlock = 0x22222222;
+  storageSave();
+  return 0;
+}
+
+int bootAndCheck() {
+  bootAndSave();
+  TEST_CHECK( commsBlock == 0x11111111 );
+  TEST_CHECK( thermBlock == 0x22222222 );
+  return testResult();
+}
+
+// Journal sector with the highest generation
+uint8_t* activeSector() {
+  uint8_t* active = NULL;
+  uint32_t generation = 0;
+  for( int i=0; i<2; i++ ) {
+    uint8_t* sector = hostFlash() + (JOURNAL_Sector + i) * HOST_SectorSize;
+    uint32_t header[2];
+    memcpy( header, sector, sizeof(header) );
+    if( (header[0] == JOURNAL_SectorMagic) && ((active == NULL) || ((int32_t)(header[1] - generation) > 0)) ) {
+      active = sector;
+      generation = header[1];
+    }
+  }
+  return active;
+}
+
+// Power loss while appending record: header is written, data is not
+void tearJournal() {
+  uint8_t* sector = activeSector();
+  int offset = 8;
+  while( (sector[offset] != 0xFF) || (sector[offset+1] != 0xFF) ) {
+    offset += (8 + (sector[offset+4] | (sector[offset+5] << 8)) + 3) & ~3;
+  }
+  static const uint8_t torn[8] = { 0x45, 0x41, 'T', 0, 4, 0, 0x12, 0x34 };
+  memcpy( sector + offset, torn, sizeof(torn) );
+}
+
+// Snapshot written by EEPROM based firmware
+void writeSnapshot() {
+  static const uint8_t snapshot[] = {
+    'A', 'E',
+    'C', 4, 0, 0x11, 0x11, 0x11, 0x11,
+    'T', 4, 0, 0x22, 0x22, 0x22, 0x22,
+    0
+  };
+  memcpy( hostFlash() + (JOURNAL_Sector + 1) * HOST_SectorSize, snapshot, sizeof(snapshot) );
+}
+
+// Compaction forced by torn journal is interrupted by power loss at given flash operation
+int bootAndLosePower( int operation ) {
+  hostPowerLossAfter( operation );
+  bootAndSave();
+  hostPowerLossAfter( 0 );
+  return 0;
+}
+
+int main() {
+  TEST_CHECK( hostBoot( firstBoot ) == 0 );
+  TEST_CHECK( hostBoot( bootAndCheck ) == 0 );
+
+  tearJournal();
+  TEST_CHECK( hostBoot( bootAndCheck ) == 0 );
+  TEST_CHECK( hostBoot( bootAndCheck ) == 0 );
+
+  // Every step of compaction: erase, records, sector header
+  for( int operation = 1; operation <= 4; operation++ ) {
+    tearJournal();
+    TEST_CHECK( hostBoot( [operation]() { return bootAndLosePower( operation ); } ) == HOST_PowerLoss );
+    TEST_CHECK( hostBoot( bootAndCheck ) == 0 );
+  }
+
+  hostFlashErase();
+  writeSnapshot();
+  TEST_CHECK( hostBoot( bootAndCheck ) == 0 );
+  TEST_CHECK( hostBoot( bootAndCheck ) == 0 );
+  return testResult();
+}
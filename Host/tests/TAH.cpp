@@ -0,0 +1,54 @@
+// Heat index and absolute humidity approximations against the formulas they replace,
+// over sensor operating range 0..50C, 0..100%RH
+#include <Arduino.h>
+#include "Test.h"
+
+extern float tahTemperature;
+extern float tahHumidity;
+float tahHeatIndex();
+float tahAbsHumidity();
+
+// Max error, g/m3 and C
+#define TAH_AbsHumidityError 0.12
+#define TAH_HeatIndexError 0.01
+
+// NWS heat index regression
+double referenceHeatIndex( double t, double h ) {
+  double f = 1.8 * t + 32.0;
+  double hi = 0.5 * (f + 61.0 + ((f - 68.0) * 1.2) + (h * 0.094));
+  if( hi > 79 ) {
+    hi = -42.379 + 2.04901523 * f + 10.14333127 * h - 0.22475541 * f * h
+      - 0.00683783 * pow( f, 2 ) - 0.05481717 * pow( h, 2 ) + 0.00122874 * pow( f, 2 ) * h
+      + 0.00085282 * f * pow( h, 2 ) - 0.00000199 * pow( f, 2 ) * pow( h, 2 );
+    if( (h < 13) && (f >= 80.0) && (f <= 112.0) ) {
+      hi -= ((13.0 - h) * 0.25) * sqrt( (17.0 - fabs( f - 95.0 )) * 0.05882 );
+    } else if( (h > 85.0) && (f >= 80.0) && (f <= 87.0) ) {
+      hi += ((h - 85.0) * 0.1) * ((87.0 - f) * 0.2);
+    }
+  }
+  return (hi - 32.0) / 1.8;
+}
+
+// Magnus formula
+double referenceAbsHumidity( double t, double h ) {
+  return 6.112 * pow( 2.71828, (17.67 * t) / (t + 243.5) ) * h * 2.1674 / (275.15 + t);
+}
+
+int main() {
+  double absError = 0;
+  double heatIndexError = 0;
+  for( int t = 0; t <= 500; t++ ) {
+    for( int h = 0; h <= 200; h++ ) {
+      tahTemperature = t / 10.0f;
+      tahHumidity = h / 2.0f;
+      double e = fabs( tahAbsHumidity() - referenceAbsHumidity( tahTemperature, tahHumidity ) );
+      if( e > absError ) absError = e;
+      e = fabs( tahHeatIndex() - referenceHeatIndex( tahTemperature, tahHumidity ) );
+      if( e > heatIndexError ) heatIndexError = e;
+    }
+  }
+  printf( "Max error: absolute humidity %.4f g/m3, heat index %.4f C\n", absError, heatIndexError );
+  TEST_CHECK( absError <= TAH_AbsHumidityError );
+  TEST_CHECK( heatIndexError <= TAH_HeatIndexError );
+  return testResult();
+}
@@ -0,0 +1,28 @@
+// HTU21D missing on I2C bus: measurements back off to the longest interval and error
+// counter is published on the first failure and then at most once a minute
+#include <Arduino.h>
+#include <string>
+#include "Host.h"
+#include "Config.h"
+#include "TAH_HTU21D.h"
+#include "Test.h"
+
+extern unsigned long tahInterval;
+extern unsigned long tahErrors;
+
+int main() {
+  hostMqttConnect( true );
+  setup();
+  testRun( 10 * 60000UL );
+  TEST_CHECK( !tahAvailable() );
+  TEST_CHECK( tahInterval == 8000 );
+  // One failed measurement per 8 seconds after backing off
+  TEST_CHECK( (tahErrors > 0) && (tahErrors <= 10 * 60 / 8 + 4) );
+
+  int reports = 0;
+  for( HostMessage& m : hostMqttMessages() ) {
+    if( m.topic.find( "/Sensors/TAHErrors" ) != std::string::npos ) reports++;
+  }
+  TEST_CHECK( (reports > 0) && (reports <= 11) );
+  return testResult();
+}
@@ -0,0 +1,39 @@
+#ifndef test_h
+#define test_h
+#include <Arduino.h>
+#include <stdio.h>
+
+// Minimal checks for host tests: failures are reported and counted, main() returns testResult()
+static int testFailures = 0;
+
+#define TEST_CHECK( condition ) \
+  do { \
+    if( !(condition) ) { \
+      printf( "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition ); \
+      testFailures++; \
+    } \
+  } while( 0 )
+
+static inline int testResult() {
+  if( testFailures > 0 ) printf( "%d check(s) failed\n", testFailures );
+  return (testFailures > 0) ? 1 : 0;
+}
+
+// Firmware entry points, see BOT313Firmware.ino
+void setup();
+void loop();
+// Call handlers registered for topic name (topic without device root), see Comms.cpp
+bool mqttDispatch( char* name, byte* payload, unsigned int length );
+
+// Run firmware main loop for ms of host time
+static inline void testRun( unsigned long ms ) {
+  unsigned long start = millis();
+  while( (unsigned long)(millis() - start) < ms ) loop();
+}
+
+// Deliver MQTT message to firmware, false if nobody subscribed to the topic
+static inline bool testSend( const char* topic, const char* payload ) {
+  return mqttDispatch( (char*)topic, (byte*)payload, strlen(payload) );
+}
+
+#endif
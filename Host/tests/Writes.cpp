@@ -0,0 +1,83 @@
+// Commands reach MCU only through write frames confirmed on hardware:
+// 0x06 to register 0..2, 0x10 to advanced parameters (2, 5 registers), clock (8, 2)
+// and whole schedule (0x0a, 12). Frames are taken from THERM_DEBUG "Log" messages
+#include <Arduino.h>
+#include <string>
+#include <vector>
+#include "Host.h"
+#include "Config.h"
+#include "Thermostat.h"
+#include "Test.h"
+
+struct Write {
+  int function;
+  int reg;
+  int count;
+};
+
+// Write frames sent since previous call
+std::vector<Write> writes() {
+  std::vector<Write> result;
+  for( HostMessage& m : hostMqttMessages() ) {
+    unsigned int address, function, reg, value;
+    if( (m.topic.find( "/Log" ) == std::string::npos)
+        || (sscanf( m.payload.c_str(), "> %2x%2x%4x%4x", &address, &function, &reg, &value ) != 4) ) continue;
+    if( function == 0x06 ) result.push_back( { 0x06, (int)reg, 1 } );
+    if( function == 0x10 ) result.push_back( { 0x10, (int)reg, (int)value } );
+  }
+  hostMqttMessages().clear();
+  return result;
+}
+
+bool confirmed( const Write& w ) {
+  if( w.function == 0x06 ) return (w.reg >= 0) && (w.reg <= 2);
+  return ((w.reg == 0x02) && (w.count == 5)) || ((w.reg == 0x08) && (w.count == 2)) || ((w.reg == 0x0a) && (w.count == 12));
+}
+
+// Run command and check frames written for it
+void command( const char* topic, const char* payload, int expected ) {
+  testSend( topic, payload );
+  testRun( 3000 );
+  std::vector<Write> w = writes();
+  bool ok = ((int)w.size() == expected);
+  for( size_t i=0; i<w.size(); i++ ) ok = ok && confirmed( w[i] );
+  TEST_CHECK( ok );
+  if( !ok ) {
+    printf( "  %s:", topic );
+    for( size_t i=0; i<w.size(); i++ ) printf( " 0x%02x to 0x%02x, %d registers;", w[i].function, w[i].reg, w[i].count );
+    printf( "\n" );
+  }
+}
+
+int main() {
+  hostMqttConnect( true );
+  setup();
+  testRun( 10000 );
+  TEST_CHECK( thermAvailable() );
+  // MCU clock is set from host time on boot
+  std::vector<Write> w = writes();
+  TEST_CHECK( w.size() > 0 );
+  for( size_t i=0; i<w.size(); i++ ) TEST_CHECK( (w[i].function == 0x10) && (w[i].reg == 0x08) && (w[i].count == 2) );
+
+  command( "SetTargetTemp", "23", 1 );
+  TEST_CHECK( thermState.targetTemp == 23 );
+  command( "SetHAMode", "auto", 2 );
+  TEST_CHECK( thermState.power && thermState.autoMode );
+  command( "SetHAMode", "heat", 2 );
+  TEST_CHECK( thermState.power && !thermState.autoMode );
+  command( "SetAntiFroze", "1", 1 );
+  TEST_CHECK( thermState.antiFroze );
+  command( "SetFloorTempMax", "30", 1 );
+  TEST_CHECK( thermState.floorTempMax == 30 );
+  command( "SetSchedule", "06:00 21;08:00 15;11:30 15;12:30 15;17:00 22;22:00 16", 1 );
+  TEST_CHECK( (thermState.schedule[2].h == 11) && (thermState.schedule[2].m == 30) );
+
+  // Commands coming together: target and advanced parameters
+  testSend( "SetTargetTemp", "22" );
+  testSend( "SetAdjTemp", "1.5" );
+  testSend( "SetAntiFroze", "0" );
+  command( "SetFloorTempMax", "35", 2 );
+  TEST_CHECK( (thermState.targetTemp == 22) && (thermState.adjTemp == 1.5) && !thermState.antiFroze && (thermState.floorTempMax == 35) );
+  TEST_CHECK( thermState.power && !thermState.autoMode );
+  return testResult();
+}